@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -15,22 +16,30 @@
 
 int write_to_client(int socket, libwebsock_client_state *state)
 {
-  int nbytes,retval = 0;
+  struct iovec iov[16];
+  ssize_t written;
+  int iovcnt;
 
-  if (state->out_data)
+  /* Everything queued for one read goes out together, partial writes stay queued. */
+  libwebsock_uncork(state);
+  while ((iovcnt = libwebsock_pending_iov(state, iov, 16, NULL)) > 0)
   {
-    nbytes = write(socket, state->out_data->data, state->out_data->data_sz);
-    if (nbytes <= 0)
+    written = writev(socket, iov, iovcnt);
+    if (written < 0)
     {
+      if (errno == EINTR)
+      {
+        continue;
+      }
       /* Write error. */
       perror("write failed");
-      retval = -1;
+      return -1;
     }
 
-    libwebsock_cleanup_outdata(state);
+    libwebsock_output_consume(state, written);
   }
 
-  return retval;
+  return 0;
 }
 
 int read_from_client(int socket, libwebsock_client_state *state)
@@ -45,7 +54,8 @@ int read_from_client(int socket, libwebsock_client_state *state)
     return -1;
   }
 
-  /* Data read. */
+  /* Data read, replies are only queued until write_to_client. */
+  libwebsock_cork(state);
   if (state->flags & STATE_CONNECTING)
   {
     if (libwebsock_populate_handshake(state, buffer, nbytes) != -1)
@@ -53,7 +63,7 @@ int read_from_client(int socket, libwebsock_client_state *state)
       retval = write_to_client(socket, state);
     }
   }
-  else if (libwebsock_handle_recv(state, buffer, nbytes) == -1)
+  else if (libwebsock_handle_recv_inplace(state, buffer, nbytes) == -1)
   {
     if (state->flags & STATE_NEEDS_MORE_DATA == 0)
     {
@@ -102,6 +112,12 @@ int onmessage_callback(libwebsock_client_state *state, libwebsock_message *msg)
 void do_processing(int socket)
 {
   libwebsock_client_state *client_state = libwebsock_client_init();
+
+  if (client_state == NULL)
+  {
+    close(socket);
+    return;
+  }
   client_state->onmessage = onmessage_callback;
 
   while (1)
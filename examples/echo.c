@@ -12,87 +12,213 @@ gcc -g -O2 -o echo echo.c -lwebsock
 
 */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <websock/websock.h>
-
-
 /*
 
-Define message callback with same prototype as below.
-Accepts pointer to libwebsock_client_state structure and pointer to libwebsock_message structure.
-libwebsock_client_state has int sockfd, struct sockaddr_storage *sa
-libwebsock_message has unsigned int opcode, unsigned long long payload_len, and char *payload
-
-You probably shouldn't modify any of the data contained in the structures passed to the callback.  It will probably cause bad things to happen.
-You can, of course, make copies of the data contained therein.
-
-Here is the default receive_callback as an example:
-(libwebsock_send_text accepts libwebsock_client_state * and character array)
-
-int some_callback_name(libwebsock_client_state *state, libwebsock_message *msg) {
-	libwebsock_send_text(state, msg->payload);
-	return 0;
-}
+A single threaded echo server for many clients at once.
 
-This callback just provides echoing messages back to the websocket client.
+Every connection is corked while the data that arrived on it is handled, so
+however many frames the callbacks send, nothing is written yet.  Once all
+readable sockets have been served, each connection with output waiting is
+uncorked and flushed with one writev() of everything it has queued.
 
-You would register this callback via:
-
-ctx->onopen = some_callback_name;
+*/
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <websock/websock.h>
 
-*/
+#define MAXMSG (4 * 1024)
+#define MAXIOV 64
 
+static libwebsock_client_state *clients[FD_SETSIZE];
 
-//basic onmessage callback, prints some information about this particular message
-//then echos back to the client.
-int 
+//echos every message back to the client it came from.
+int
 onmessage(libwebsock_client_state *state, libwebsock_message *msg)
 {
-  fprintf(stderr, "Received message from client: %d\n", state->sockfd);
   fprintf(stderr, "Message opcode: %d\n", msg->opcode);
   fprintf(stderr, "Payload Length: %llu\n", msg->payload_len);
-  fprintf(stderr, "Payload: %s\n", msg->payload);
-  //now let's send it back.
-  libwebsock_send_text(state, msg->payload);
-  return 0;
+  if (msg->opcode == WS_OPCODE_TEXT)
+  {
+    return libwebsock_make_text_data_frame_with_length(state, msg->payload, msg->payload_len) == -1 ? -1 : 0;
+  }
+  return libwebsock_make_binary_data_frame(state, msg->payload, msg->payload_len) == -1 ? -1 : 0;
 }
 
+//writes as much of the queued output as the socket takes, one writev at a time
 int
-onopen(libwebsock_client_state *state)
+flush_client(int sockfd, libwebsock_client_state *state)
 {
-  fprintf(stderr, "onopen: %d\n", state->sockfd);
+  struct iovec iov[MAXIOV];
+  ssize_t written;
+  size_t nbytes;
+  int iovcnt;
+
+  libwebsock_uncork(state);
+  while ((iovcnt = libwebsock_pending_iov(state, iov, MAXIOV, &nbytes)) > 0)
+  {
+    written = writev(sockfd, iov, iovcnt);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("write failed");
+      return -1;
+    }
+    libwebsock_output_consume(state, written);
+    if ((size_t)written < nbytes)
+    {
+      //the socket is full, try again on the next round
+      break;
+    }
+  }
   return 0;
 }
 
+//feeds whatever arrived to the library, corked so replies are only queued
 int
-onclose(libwebsock_client_state *state)
+read_client(int sockfd, libwebsock_client_state *state)
 {
-  fprintf(stderr, "onclose: %d\n", state->sockfd);
+  char buffer[MAXMSG];
+  ssize_t nbytes;
+
+  nbytes = read(sockfd, buffer, MAXMSG);
+  if (nbytes <= 0)
+  {
+    return -1;
+  }
+
+  libwebsock_cork(state);
+  if (state->flags & STATE_CONNECTING)
+  {
+    return libwebsock_populate_handshake(state, buffer, nbytes) == -1 ? -1 : 0;
+  }
+  if (libwebsock_handle_recv_inplace(state, buffer, nbytes) == -1 && (state->flags & STATE_NEEDS_MORE_DATA) == 0)
+  {
+    return -1;
+  }
   return 0;
 }
 
+void
+drop_client(int sockfd)
+{
+  fprintf(stderr, "onclose: %d\n", sockfd);
+  libwebsock_client_destroy(clients[sockfd]);
+  clients[sockfd] = NULL;
+  close(sockfd);
+}
+
 int
 main(int argc, char *argv[])
 {
-  libwebsock_context *ctx = NULL;
-  if(argc != 2) {
+  struct sockaddr_in server_addr;
+  int listening_socket, sockfd, maxfd;
+  fd_set readable;
+
+  if (argc != 2)
+  {
     fprintf(stderr, "Usage: %s <port to listen on>\n\nNote: You must be root to bind to port below 1024\n", argv[0]);
     exit(0);
   }
-  ctx = libwebsock_init();
-  if(ctx == NULL) {
-    fprintf(stderr, "Error during libwebsock_init.\n");
+
+  listening_socket = socket(PF_INET, SOCK_STREAM, 0);
+  if (listening_socket < 0)
+  {
+    perror("failed to create listening socket");
+    exit(1);
+  }
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(atoi(argv[1]));
+  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listening_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+      listen(listening_socket, 16) < 0)
+  {
+    perror("failed to listen");
     exit(1);
   }
-  libwebsock_bind(ctx, "0.0.0.0", argv[1]);
   fprintf(stderr, "libwebsock listening on port %s\n", argv[1]);
-  ctx->onmessage = onmessage;
-  ctx->onopen = onopen;
-  ctx->onclose = onclose;
-  libwebsock_wait(ctx);
-  //perform any cleanup here.
-  fprintf(stderr, "Exiting.\n");
+
+  while (1)
+  {
+    FD_ZERO(&readable);
+    FD_SET(listening_socket, &readable);
+    maxfd = listening_socket;
+    for (sockfd = 0; sockfd < FD_SETSIZE; sockfd++)
+    {
+      if (clients[sockfd] != NULL)
+      {
+        FD_SET(sockfd, &readable);
+        maxfd = sockfd > maxfd ? sockfd : maxfd;
+      }
+    }
+
+    if (select(maxfd + 1, &readable, NULL, NULL, NULL) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("select failed");
+      exit(1);
+    }
+
+    if (FD_ISSET(listening_socket, &readable))
+    {
+      sockfd = accept(listening_socket, NULL, NULL);
+      if (sockfd >= FD_SETSIZE)
+      {
+        close(sockfd);
+      }
+      else if (sockfd >= 0)
+      {
+        clients[sockfd] = libwebsock_client_init();
+        if (clients[sockfd] == NULL)
+        {
+          fprintf(stderr, "out of memory, dropping %d\n", sockfd);
+          close(sockfd);
+        }
+        else
+        {
+          fprintf(stderr, "onopen: %d\n", sockfd);
+          clients[sockfd]->onmessage = onmessage;
+        }
+      }
+    }
+
+    //first let every connection queue its replies...
+    for (sockfd = 0; sockfd <= maxfd; sockfd++)
+    {
+      if (clients[sockfd] != NULL && FD_ISSET(sockfd, &readable) && read_client(sockfd, clients[sockfd]) == -1)
+      {
+        drop_client(sockfd);
+      }
+    }
+
+    //...then write them out, one writev per connection
+    for (sockfd = 0; sockfd <= maxfd; sockfd++)
+    {
+      if (clients[sockfd] == NULL)
+      {
+        continue;
+      }
+      if (flush_client(sockfd, clients[sockfd]) == -1 || (clients[sockfd]->flags & STATE_SHOULD_CLOSE))
+      {
+        drop_client(sockfd);
+      }
+    }
+  }
+
   return 0;
 }
@@ -30,6 +30,10 @@
 #include "websock.h"
 #include "logger.h"
 
+//limits copied into every new client state, 0 means unlimited
+static size_t default_max_frame_size = 0;
+static size_t default_max_message_size = 0;
+
 const char *
 libwebsock_version_string(void)
 {
@@ -38,14 +42,14 @@ libwebsock_version_string(void)
 
 void libwebsock_dump_frame(libwebsock_client_state *state, libwebsock_frame *frame)
 {
-    int i;
+    size_t i;
     logdebug("FIN: %d", frame->fin);
     logdebug("Opcode: %d", frame->opcode);
     logdebug("mask_offset: %d", frame->mask_offset);
     logdebug("payload_offset: %d", frame->payload_offset);
-    logdebug("rawdata_idx: %d", frame->rawdata_idx);
-    logdebug("rawdata_sz: %d", frame->rawdata_sz);
-    logdebug("payload_len: %u", frame->payload_len);
+    logdebug("rawdata_idx: %llu", (unsigned long long)frame->rawdata_idx);
+    logdebug("rawdata_sz: %zu", frame->rawdata_sz);
+    logdebug("payload_len: %llu", (unsigned long long)frame->payload_len);
     logdebug("Has previous frame: %d", frame->prev_frame != NULL ? 1 : 0);
     logdebug("Has next frame: %d", frame->next_frame != NULL ? 1 : 0);
     logdebug("Raw data:");
@@ -96,9 +100,9 @@ int libwebsock_make_close_frame_with_reason(libwebsock_client_state *state, unsi
     return ret;
 }
 
-int libwebsock_make_text_data_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len)
+ssize_t libwebsock_make_text_data_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len)
 {
-    logdebug("text data frame for payload of size %u", payload_len);
+    logdebug("text data frame for payload of size %zu", payload_len);
 
     if (state->flags & STATE_CONTINUOUS_FRAME_IN_PROGRESS)
     {
@@ -110,9 +114,9 @@ int libwebsock_make_text_data_frame_with_length(libwebsock_client_state *state,
     return libwebsock_make_fragment(state, strdata, payload_len, flags);
 }
 
-int libwebsock_make_text_data_frame(libwebsock_client_state *state, char *strdata)
+ssize_t libwebsock_make_text_data_frame(libwebsock_client_state *state, char *strdata)
 {
-    unsigned int len = strlen(strdata);
+    size_t len = strlen(strdata);
 
     if (state->flags & STATE_CONTINUOUS_FRAME_IN_PROGRESS)
     {
@@ -124,9 +128,9 @@ int libwebsock_make_text_data_frame(libwebsock_client_state *state, char *strdat
     return libwebsock_make_fragment(state, strdata, len, flags);
 }
 
-int libwebsock_make_binary_data_frame(libwebsock_client_state *state, char *in_data, unsigned int payload_len)
+ssize_t libwebsock_make_binary_data_frame(libwebsock_client_state *state, char *in_data, size_t payload_len)
 {
-    logdebug("binary data frame for payload of size %u", payload_len);
+    logdebug("binary data frame for payload of size %zu", payload_len);
 
     if (state->flags & STATE_CONTINUOUS_FRAME_IN_PROGRESS)
     {
@@ -137,79 +141,176 @@ int libwebsock_make_binary_data_frame(libwebsock_client_state *state, char *in_d
     return libwebsock_make_fragment(state, in_data, payload_len, flags);
 }
 
-int libwebsock_make_init_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len)
+ssize_t libwebsock_make_text_data_frame_zerocopy(libwebsock_client_state *state, const char *strdata, size_t payload_len,
+                                               libwebsock_release_fn release, void *release_arg)
+{
+    logdebug("zero-copy text data frame for payload of size %zu", payload_len);
+
+    if (state->flags & STATE_CONTINUOUS_FRAME_IN_PROGRESS)
+    {
+        logerror("Invalid call. A continous frame is in progress.");
+        return -1;
+    }
+    int flags = WS_FRAGMENT_FIN | WS_OPCODE_TEXT;
+    return libwebsock_make_fragment_zerocopy(state, strdata, payload_len, flags, release, release_arg);
+}
+
+ssize_t libwebsock_make_binary_data_frame_zerocopy(libwebsock_client_state *state, const char *in_data, size_t payload_len,
+                                                 libwebsock_release_fn release, void *release_arg)
 {
-    logdebug("init continuation text data frame for payload of size %u", payload_len);
+    logdebug("zero-copy binary data frame for payload of size %zu", payload_len);
+
+    if (state->flags & STATE_CONTINUOUS_FRAME_IN_PROGRESS)
+    {
+        logerror("Invalid call. A continous frame is in progress.");
+        return -1;
+    }
+    int flags = WS_FRAGMENT_FIN | WS_OPCODE_BINARY;
+    return libwebsock_make_fragment_zerocopy(state, in_data, payload_len, flags, release, release_arg);
+}
+
+ssize_t libwebsock_make_init_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len)
+{
+    logdebug("init continuation text data frame for payload of size %zu", payload_len);
     state->flags |= STATE_CONTINUOUS_FRAME_IN_PROGRESS;
     int flags = WS_OPCODE_TEXT;
     return libwebsock_make_fragment(state, strdata, payload_len, flags);
 }
 
-int libwebsock_make_init_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, unsigned int payload_len)
+ssize_t libwebsock_make_init_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, size_t payload_len)
 {
-    logdebug("init continuation binary data frame for payload of size %u", payload_len);
+    logdebug("init continuation binary data frame for payload of size %zu", payload_len);
     state->flags |= STATE_CONTINUOUS_FRAME_IN_PROGRESS;
     int flags = WS_OPCODE_BINARY;
     return libwebsock_make_fragment(state, in_data, payload_len, flags);
 }
 
-int libwebsock_make_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len)
+ssize_t libwebsock_make_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len)
 {
-    logdebug("continuation text data frame for payload of size %u", payload_len);
+    logdebug("continuation text data frame for payload of size %zu", payload_len);
     int flags = WS_OPCODE_CONTINUE;
     return libwebsock_make_fragment(state, strdata, payload_len, flags);
 }
 
-int libwebsock_make_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, unsigned int payload_len)
+ssize_t libwebsock_make_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, size_t payload_len)
 {
-    logdebug("continuation binary data frame for payload of size %u", payload_len);
+    logdebug("continuation binary data frame for payload of size %zu", payload_len);
     int flags = WS_OPCODE_CONTINUE;
     return libwebsock_make_fragment(state, in_data, payload_len, flags);
 }
 
-int libwebsock_make_end_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len)
+ssize_t libwebsock_make_end_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len)
 {
-    logdebug("end continuation text data frame for payload of size %u", payload_len);
+    logdebug("end continuation text data frame for payload of size %zu", payload_len);
     state->flags &= ~STATE_CONTINUOUS_FRAME_IN_PROGRESS;
     int flags = WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE;
     return libwebsock_make_fragment(state, strdata, payload_len, flags);
 }
 
-int libwebsock_make_end_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, unsigned int payload_len)
+ssize_t libwebsock_make_end_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, size_t payload_len)
 {
-    logdebug("end continuation binary data frame for payload of size %u", payload_len);
+    logdebug("end continuation binary data frame for payload of size %zu", payload_len);
     state->flags &= ~STATE_CONTINUOUS_FRAME_IN_PROGRESS;
     int flags = WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE;
     return libwebsock_make_fragment(state, in_data, payload_len, flags);
 }
 
+/*
+ * Sets the max_frame_size and max_message_size that states created from now
+ * on start with, 0 for no limit; a state's own limits can be changed on it
+ * at any time.  There is no context object to hang these on, so the
+ * defaults are process-wide and shared by every server in the process.
+ * They are not synchronized: set them once at startup, before any thread
+ * creates states.
+ */
+void libwebsock_set_default_size_limits(size_t max_frame_size, size_t max_message_size)
+{
+    default_max_frame_size = max_frame_size;
+    default_max_message_size = max_message_size;
+}
+
+/*
+ * The allocator libwebsock_client_init, pools and shared frames use; NULL
+ * puts the libc allocator back.  Like the size limits this is process-wide
+ * and unsynchronized, so set it before any thread creates states.
+ */
+void libwebsock_set_default_allocator(const libwebsock_allocator *allocator)
+{
+    lws_default_allocator = allocator != NULL ? *allocator : lws_libc_allocator;
+}
+
 libwebsock_client_state *libwebsock_client_init(void)
 {
-    libwebsock_client_state *state = (libwebsock_client_state *)lws_calloc(sizeof(libwebsock_client_state));
+    return libwebsock_client_init_with_allocator(&lws_default_allocator);
+}
+
+/*
+ * Everything the state allocates over its lifetime, the state itself
+ * included, goes through the given allocator.  Returns NULL if the state
+ * can't be allocated.
+ */
+libwebsock_client_state *libwebsock_client_init_with_allocator(const libwebsock_allocator *allocator)
+{
+    libwebsock_client_state *state = (libwebsock_client_state *)allocator->malloc_fn(allocator->ctx, sizeof(libwebsock_client_state));
+    if (state == NULL)
+    {
+        logerror("unable to allocate client state");
+        return NULL;
+    }
+    memset(state, 0, sizeof(libwebsock_client_state));
+    state->allocator = *allocator;
+    state->message_allocator = *allocator;
     state->oncontrol = libwebsock_default_control_callback;
     state->onmessage = libwebsock_default_onmessage_callback;
     state->onping = libwebsock_default_onping_callback;
     state->onclose = libwebsock_default_onclose_callback;
     state->onerror = libwebsock_default_onerror_callback;
     state->onpong = NULL;
+    state->max_frame_size = default_max_frame_size;
+    state->max_message_size = default_max_message_size;
     state->flags |= STATE_CONNECTING;
 
     loginfo("websocket client initialized");
     return state;
 }
 
+/*
+ * Gives message payloads an allocator of their own, for example a bump
+ * arena.  reset, which may be NULL, is called with the allocator's ctx each
+ * time no delivered payload is referenced any more: after onmessage or
+ * onmessage_chunk returns for a reassembled or decoded message, and after
+ * onmessage_batch.  While reset is set no payload buffer is kept from one
+ * message to the next.  Frames, the output queue and the state itself
+ * still use the state's allocator.  Returns -1 after the handshake.
+ */
+int libwebsock_set_message_allocator(libwebsock_client_state *state, const libwebsock_allocator *allocator, void (*reset)(void *ctx))
+{
+    if (state->flags & STATE_CONNECTED)
+    {
+        logerror("the message allocator must be set before the handshake");
+        return -1;
+    }
+    state->message_allocator = allocator != NULL ? *allocator : state->allocator;
+    state->message_reset = reset;
+    return 0;
+}
+
 void libwebsock_client_destroy(libwebsock_client_state *state)
 {
     if (state)
     {
         if (state->close_info)
         {
-            lws_free(state->close_info);
+            lws_state_free(state, state->close_info);
             state->close_info = NULL;
         }
         libwebsock_cleanup_outdata(state);
         libwebsock_free_all_frames(state);
+        lws_deflate_free(state);
+        lws_extension_free(state);
+        lws_state_free(state, state->batch);
+        lws_state_free(state, state->batch_owned);
         loginfo("websocket client destroyed");
-        lws_free(state);
+        lws_state_free(state, state);
     }
 }
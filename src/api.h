@@ -20,6 +20,7 @@
 #ifndef API_H_
 #define API_H_
 
+#include <sys/types.h>
 #include "types.h"
 
 const char *libwebsock_version_string(void);
@@ -27,16 +28,22 @@ int libwebsock_make_ping_frame(libwebsock_client_state *state);
 int libwebsock_make_pong_frame(libwebsock_client_state *state, const char *data, unsigned int len);
 int libwebsock_make_close_frame(libwebsock_client_state *state);
 int libwebsock_make_close_frame_with_reason(libwebsock_client_state *state, unsigned short code, const char *reason);
-int libwebsock_make_binary_data_frame(libwebsock_client_state *state, char *in_data, unsigned int payload_len);
-int libwebsock_make_text_data_frame(libwebsock_client_state *state, char *strdata);
-int libwebsock_make_text_data_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len);
-int libwebsock_make_init_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len);
-int libwebsock_make_init_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, unsigned int payload_len);
-int libwebsock_make_end_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len);
-int libwebsock_make_end_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, unsigned int payload_len);
-int libwebsock_make_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, unsigned int payload_len);
-int libwebsock_make_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, unsigned int payload_len);
+ssize_t libwebsock_make_binary_data_frame(libwebsock_client_state *state, char *in_data, size_t payload_len);
+ssize_t libwebsock_make_text_data_frame(libwebsock_client_state *state, char *strdata);
+ssize_t libwebsock_make_text_data_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len);
+ssize_t libwebsock_make_text_data_frame_zerocopy(libwebsock_client_state *state, const char *strdata, size_t payload_len, libwebsock_release_fn release, void *release_arg);
+ssize_t libwebsock_make_binary_data_frame_zerocopy(libwebsock_client_state *state, const char *in_data, size_t payload_len, libwebsock_release_fn release, void *release_arg);
+ssize_t libwebsock_make_init_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len);
+ssize_t libwebsock_make_init_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, size_t payload_len);
+ssize_t libwebsock_make_end_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len);
+ssize_t libwebsock_make_end_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, size_t payload_len);
+ssize_t libwebsock_make_text_continuation_frame_with_length(libwebsock_client_state *state, char *strdata, size_t payload_len);
+ssize_t libwebsock_make_binary_continuation_frame_with_length(libwebsock_client_state *state, char *in_data, size_t payload_len);
+void libwebsock_set_default_size_limits(size_t max_frame_size, size_t max_message_size);
+void libwebsock_set_default_allocator(const libwebsock_allocator *allocator);
 libwebsock_client_state *libwebsock_client_init(void);
+libwebsock_client_state *libwebsock_client_init_with_allocator(const libwebsock_allocator *allocator);
+int libwebsock_set_message_allocator(libwebsock_client_state *state, const libwebsock_allocator *allocator, void (*reset)(void *ctx));
 void libwebsock_client_destroy(libwebsock_client_state *state);
 
 #endif /* API_H_ */
@@ -64,7 +64,6 @@ int libwebsock_default_onerror_callback(libwebsock_client_state *state, unsigned
 
 int libwebsock_default_control_callback(libwebsock_client_state *state, libwebsock_frame *ctl_frame)
 {
-  int i;
   int retval = 0;
 
   /*
@@ -83,16 +82,13 @@ int libwebsock_default_control_callback(libwebsock_client_state *state, libwebso
 
   if (ctl_frame->payload_len > 125)
   {
-    logerror("control frame payload greater than 125 bytes - %u", ctl_frame->payload_len);
+    logerror("control frame payload greater than 125 bytes - %llu", (unsigned long long)ctl_frame->payload_len);
     return libwebsock_error(state, WS_CLOSE_PROTOCOL_ERROR);
   }
 
-  for (i = 0; i < ctl_frame->payload_len; i++)
-  {
-    //this demasks the payload
-    *(ctl_frame->rawdata + ctl_frame->payload_offset + i) =
-        *(ctl_frame->rawdata + ctl_frame->payload_offset + i) ^ (ctl_frame->mask[i % 4] & 0xff);
-  }
+  //this demasks the payload
+  lws_unmask(ctl_frame->rawdata + ctl_frame->payload_offset, ctl_frame->rawdata + ctl_frame->payload_offset,
+             ctl_frame->payload_len, ctl_frame->mask, 0);
 
   switch (ctl_frame->opcode)
   {
@@ -109,7 +105,7 @@ int libwebsock_default_control_callback(libwebsock_client_state *state, libwebso
     if (!state->close_info && ctl_frame->payload_len >= 2)
     {
       logdebug("populating close info");
-      libwebsock_populate_close_info_from_frame(&state->close_info, ctl_frame);
+      libwebsock_populate_close_info_from_frame(state, &state->close_info, ctl_frame);
     }
 
     if (state->close_info)
@@ -122,7 +118,8 @@ int libwebsock_default_control_callback(libwebsock_client_state *state, libwebso
         logerror("Invalid close code %u in the payload", code);
         return libwebsock_error(state, WS_CLOSE_PROTOCOL_ERROR);
       }
-      else if (!validate_utf8_sequence((uint8_t *)state->close_info->reason))
+      else if (ctl_frame->payload_len > 2 &&
+               !validate_utf8_sequence((uint8_t *)ctl_frame->rawdata + ctl_frame->payload_offset + 2, ctl_frame->payload_len - 2))
       {
         logerror("payload is not valid UTF-8 sequence", code);
         return libwebsock_fail_and_cleanup(state);
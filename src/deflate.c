@@ -0,0 +1,1103 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <zlib.h>
+#include "websock.h"
+#include "logger.h"
+
+/*
+ * permessage-deflate (RFC 7692).  Every message is compressed with a sync
+ * flush and sent without the 00 00 ff ff that ends it; the receiver puts it
+ * back before inflating.  Both zlib streams are set up on first use and
+ * allocate through the connection's allocator, so their memory is counted
+ * and can be capped.  With context takeover the streams keep their window
+ * from one message to the next, otherwise they are reset after each.
+ *
+ * A connection given a pool runs without context takeover on both sides
+ * and owns no stream between messages: it borrows one for each message it
+ * compresses or inflates and gives it back once done.  Each call goes
+ * through a whole message, so a thread needs one stream per direction at a
+ * time however many connections it serves.  Two connections using the same
+ * pool dictionary agree on it with the x_lws_dictionary parameter, carrying
+ * the dictionary's Adler-32; peers that don't know it pick the plain offer
+ * that follows.
+ */
+
+//zlib expects malloc alignment, the block length sits in front of it
+#define DEFLATE_ALLOC_HEADER 16
+#define DEFLATE_MIN_WINDOW_BITS 9
+#define DEFLATE_MAX_WINDOW_BITS 15
+#define DEFLATE_DEFAULT_MEM_LEVEL 8
+#define DEFLATE_POOL_DEFAULT_IDLE 2
+#define DEFLATE_DICTIONARY_PARAM "x_lws_dictionary"
+
+#define LWS_ZSTREAM_DEFLATE 0
+#define LWS_ZSTREAM_INFLATE 1
+
+/*
+ * A zlib stream and the settings it was set up with.  A pooled stream
+ * counts what zlib holds for it and charges it to the connection that has
+ * borrowed it, if any.
+ */
+typedef struct _lws_zstream
+{
+  struct _lws_zstream *next;
+  struct _libwebsock_deflate_pool *pool;
+  struct _libwebsock_deflate *owner;
+  size_t memory;
+  int bits;
+  int level;
+  int mem_level;
+  z_stream z;
+} lws_zstream;
+
+struct _libwebsock_deflate_pool
+{
+  libwebsock_allocator allocator;
+  size_t max_idle;
+  lws_zstream *idle[2];
+  size_t idle_count[2];
+  size_t memory;
+  char *dictionary;
+  size_t dictionary_len;
+  unsigned long dictionary_id;
+  char *out;
+  size_t out_sz;
+};
+
+typedef struct _libwebsock_deflate
+{
+  libwebsock_deflate_options options;
+  int deflate_bits;
+  int inflate_bits;
+  int mem_level;
+  int deflate_no_context_takeover;
+  int inflate_no_context_takeover;
+  int dictionary;
+  lws_zstream *stream[2];
+  size_t memory;
+  char *out;
+  size_t out_sz;
+  char *in;
+  size_t in_sz;
+} libwebsock_deflate;
+
+//one permessage-deflate offer or response, 0 for an absent window size
+typedef struct
+{
+  int server_no_context_takeover;
+  int client_no_context_takeover;
+  int server_max_window_bits;
+  int client_max_window_bits;
+  int dictionary;
+  unsigned long dictionary_id;
+} lws_deflate_params;
+
+static voidpf lws_deflate_zalloc(voidpf opaque, uInt items, uInt size)
+{
+  libwebsock_client_state *state = (libwebsock_client_state *)opaque;
+  libwebsock_deflate *ctx = state->deflate;
+  size_t len = (size_t)items * size;
+  char *block;
+
+  if (ctx->options.memory_limit > 0 && ctx->memory + len > ctx->options.memory_limit)
+  {
+    logerror("compression would need more than %zu bytes", ctx->options.memory_limit);
+    return Z_NULL;
+  }
+  block = (char *)lws_state_malloc(state, DEFLATE_ALLOC_HEADER + len);
+  if (block == NULL)
+  {
+    return Z_NULL;
+  }
+  memcpy(block, &len, sizeof(len));
+  ctx->memory += len;
+  return block + DEFLATE_ALLOC_HEADER;
+}
+
+static void lws_deflate_zfree(voidpf opaque, voidpf ptr)
+{
+  libwebsock_client_state *state = (libwebsock_client_state *)opaque;
+  char *block = (char *)ptr - DEFLATE_ALLOC_HEADER;
+  size_t len;
+
+  memcpy(&len, block, sizeof(len));
+  state->deflate->memory -= len;
+  lws_state_free(state, block);
+}
+
+/*
+ * Pooled streams outlive connections, so they allocate from the pool, but
+ * are held to the memory_limit of the connection using them.
+ */
+static voidpf lws_pool_zalloc(voidpf opaque, uInt items, uInt size)
+{
+  lws_zstream *s = (lws_zstream *)opaque;
+  libwebsock_deflate *owner = s->owner;
+  size_t len = (size_t)items * size;
+  char *block;
+
+  if (owner != NULL && owner->options.memory_limit > 0 && owner->memory + len > owner->options.memory_limit)
+  {
+    return Z_NULL;
+  }
+  block = (char *)s->pool->allocator.malloc_fn(s->pool->allocator.ctx, DEFLATE_ALLOC_HEADER + len);
+  if (block == NULL)
+  {
+    return Z_NULL;
+  }
+  memcpy(block, &len, sizeof(len));
+  s->memory += len;
+  s->pool->memory += len;
+  if (owner != NULL)
+  {
+    owner->memory += len;
+  }
+  return block + DEFLATE_ALLOC_HEADER;
+}
+
+static void lws_pool_zfree(voidpf opaque, voidpf ptr)
+{
+  lws_zstream *s = (lws_zstream *)opaque;
+  char *block = (char *)ptr - DEFLATE_ALLOC_HEADER;
+  size_t len;
+
+  memcpy(&len, block, sizeof(len));
+  s->memory -= len;
+  s->pool->memory -= len;
+  if (s->owner != NULL)
+  {
+    s->owner->memory -= len;
+  }
+  s->pool->allocator.free_fn(s->pool->allocator.ctx, block);
+}
+
+//what zlib allocates for the two streams, with room for its bookkeeping
+static size_t lws_deflate_estimate(int deflate_bits, int mem_level, int inflate_bits)
+{
+  size_t deflate_mem = ((size_t)1 << (deflate_bits + 2)) + ((size_t)9 << (mem_level + 6)) + 8 * 1024;
+  size_t inflate_mem = ((size_t)1 << inflate_bits) + 8 * 1024;
+
+  return deflate_mem + inflate_mem;
+}
+
+/*
+ * Shrinks the compressor's window and hash tables, whichever is larger at
+ * each step, until both streams fit under memory_limit, and the peer's
+ * window only once ours are as small as they go and only if it agreed to be
+ * limited.  Returns -1 if they can't be made to fit.
+ */
+static int lws_deflate_fit(libwebsock_deflate *ctx, int *deflate_bits, int *mem_level, int *inflate_bits,
+                           int inflate_limited)
+{
+  size_t limit = ctx->options.memory_limit;
+
+  while (limit > 0 && lws_deflate_estimate(*deflate_bits, *mem_level, *inflate_bits) > limit)
+  {
+    if (*deflate_bits > DEFLATE_MIN_WINDOW_BITS &&
+        (*mem_level <= 1 || ((size_t)1 << (*deflate_bits + 2)) >= ((size_t)9 << (*mem_level + 6))))
+    {
+      (*deflate_bits)--;
+    }
+    else if (*mem_level > 1)
+    {
+      (*mem_level)--;
+    }
+    else if (inflate_limited && *inflate_bits > DEFLATE_MIN_WINDOW_BITS)
+    {
+      (*inflate_bits)--;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void lws_deflate_trim_space(const char **start, const char **end)
+{
+  while (*start < *end && (**start == ' ' || **start == '\t'))
+  {
+    (*start)++;
+  }
+  while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t'))
+  {
+    (*end)--;
+  }
+}
+
+static int lws_deflate_token_is(const char *s, const char *end, const char *token)
+{
+  return (size_t)(end - s) == strlen(token) && strncasecmp(s, token, end - s) == 0;
+}
+
+//a window size is a plain or quoted number from 8 to 15
+static int lws_deflate_parse_bits(const char *value, const char *end)
+{
+  int bits = 0;
+
+  if (end - value >= 2 && *value == '"' && end[-1] == '"')
+  {
+    value++;
+    end--;
+  }
+  if (value == end || end - value > 2)
+  {
+    return -1;
+  }
+  for (; value < end; value++)
+  {
+    if (*value < '0' || *value > '9')
+    {
+      return -1;
+    }
+    bits = bits * 10 + (*value - '0');
+  }
+  return bits >= 8 && bits <= DEFLATE_MAX_WINDOW_BITS ? bits : -1;
+}
+
+//a dictionary id is a plain decimal Adler-32, returns -1 if it isn't one
+static int lws_deflate_parse_id(const char *value, const char *end, unsigned long *id)
+{
+  unsigned long long n = 0;
+
+  if (value == end || end - value > 10)
+  {
+    return -1;
+  }
+  for (; value < end; value++)
+  {
+    if (*value < '0' || *value > '9')
+    {
+      return -1;
+    }
+    n = n * 10 + (*value - '0');
+  }
+  if (n > 0xffffffffULL)
+  {
+    return -1;
+  }
+  *id = (unsigned long)n;
+  return 0;
+}
+
+/*
+ * Parses one element of a Sec-WebSocket-Extensions value, the text between
+ * two commas.  Returns 1 for a well formed permessage-deflate element, 0
+ * for any other extension and -1 for a malformed or repeated parameter.  A
+ * client_max_window_bits without a value is stored as -1.
+ */
+static int lws_deflate_parse(const char *s, const char *end, lws_deflate_params *params)
+{
+  const char *name, *name_end, *value, *value_end, *next;
+  unsigned long id = 0;
+  int bits, id_ok;
+
+  memset(params, 0, sizeof(lws_deflate_params));
+  next = memchr(s, ';', end - s);
+  name_end = next != NULL ? next : end;
+  lws_deflate_trim_space(&s, &name_end);
+  if (!lws_deflate_token_is(s, name_end, DEFLATE_EXTENSION_NAME))
+  {
+    return 0;
+  }
+
+  while (next != NULL)
+  {
+    name = next + 1;
+    next = memchr(name, ';', end - name);
+    name_end = next != NULL ? next : end;
+    value = memchr(name, '=', name_end - name);
+    value_end = name_end;
+    bits = 0;
+    id_ok = -1;
+    if (value != NULL)
+    {
+      name_end = value++;
+      lws_deflate_trim_space(&value, &value_end);
+      bits = lws_deflate_parse_bits(value, value_end);
+      id_ok = lws_deflate_parse_id(value, value_end, &id);
+    }
+    lws_deflate_trim_space(&name, &name_end);
+
+    if (lws_deflate_token_is(name, name_end, "server_no_context_takeover") && value == NULL &&
+        !params->server_no_context_takeover)
+    {
+      params->server_no_context_takeover = 1;
+    }
+    else if (lws_deflate_token_is(name, name_end, "client_no_context_takeover") && value == NULL &&
+             !params->client_no_context_takeover)
+    {
+      params->client_no_context_takeover = 1;
+    }
+    else if (lws_deflate_token_is(name, name_end, "server_max_window_bits") && value != NULL && bits > 0 &&
+             params->server_max_window_bits == 0)
+    {
+      params->server_max_window_bits = bits;
+    }
+    else if (lws_deflate_token_is(name, name_end, "client_max_window_bits") && (value == NULL || bits > 0) &&
+             params->client_max_window_bits == 0)
+    {
+      params->client_max_window_bits = value != NULL ? bits : -1;
+    }
+    else if (lws_deflate_token_is(name, name_end, DEFLATE_DICTIONARY_PARAM) && id_ok == 0 && !params->dictionary)
+    {
+      params->dictionary = 1;
+      params->dictionary_id = id;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Lets the connection negotiate permessage-deflate in its opening
+ * handshake, with options or the defaults when NULL.  Zero fields take the
+ * defaults too; window sizes go from 9 to 15.  A pool turns context
+ * takeover off both ways.  Returns -1 on bad options.
+ */
+int libwebsock_enable_deflate(libwebsock_client_state *state, const libwebsock_deflate_options *options)
+{
+  libwebsock_deflate *ctx;
+  libwebsock_deflate_options opts;
+
+  if (options != NULL)
+  {
+    opts = *options;
+  }
+  else
+  {
+    memset(&opts, 0, sizeof(opts));
+  }
+  opts.level = opts.level != 0 ? opts.level : Z_DEFAULT_COMPRESSION;
+  opts.mem_level = opts.mem_level != 0 ? opts.mem_level : DEFLATE_DEFAULT_MEM_LEVEL;
+  opts.server_max_window_bits = opts.server_max_window_bits != 0 ? opts.server_max_window_bits : DEFLATE_MAX_WINDOW_BITS;
+  opts.client_max_window_bits = opts.client_max_window_bits != 0 ? opts.client_max_window_bits : DEFLATE_MAX_WINDOW_BITS;
+  if (opts.pool != NULL)
+  {
+    opts.server_no_context_takeover = 1;
+    opts.client_no_context_takeover = 1;
+  }
+  if (opts.level < Z_DEFAULT_COMPRESSION || opts.level > Z_BEST_COMPRESSION || opts.mem_level < 1 ||
+      opts.mem_level > MAX_MEM_LEVEL || opts.server_max_window_bits < DEFLATE_MIN_WINDOW_BITS ||
+      opts.server_max_window_bits > DEFLATE_MAX_WINDOW_BITS || opts.client_max_window_bits < DEFLATE_MIN_WINDOW_BITS ||
+      opts.client_max_window_bits > DEFLATE_MAX_WINDOW_BITS)
+  {
+    logerror("invalid permessage-deflate options");
+    return -1;
+  }
+  if (state->flags & STATE_DEFLATE)
+  {
+    logerror("permessage-deflate is already in use");
+    return -1;
+  }
+
+  if (state->deflate == NULL)
+  {
+    ctx = (libwebsock_deflate *)lws_state_calloc(state, sizeof(libwebsock_deflate));
+    if (ctx == NULL)
+    {
+      return -1;
+    }
+    state->deflate = ctx;
+  }
+  state->deflate->options = opts;
+  state->deflate->deflate_bits = DEFLATE_MAX_WINDOW_BITS;
+  state->deflate->inflate_bits = DEFLATE_MAX_WINDOW_BITS;
+  state->deflate->mem_level = opts.mem_level;
+  state->deflate->dictionary = 0;
+  return 0;
+}
+
+//bytes zlib currently holds for the connection, counting streams it has borrowed
+size_t libwebsock_deflate_memory(libwebsock_client_state *state)
+{
+  return state->deflate != NULL ? state->deflate->memory : 0;
+}
+
+/*
+ * Makes a pool for the connections of one thread to share their zlib
+ * streams through; it takes no locks.  Allocates from the default
+ * allocator and copies the dictionary.  Returns NULL if out of memory.
+ */
+libwebsock_deflate_pool *libwebsock_deflate_pool_new(const libwebsock_deflate_pool_options *options)
+{
+  libwebsock_deflate_pool *pool;
+
+  pool = (libwebsock_deflate_pool *)lws_default_allocator.malloc_fn(lws_default_allocator.ctx, sizeof(libwebsock_deflate_pool));
+  if (pool == NULL)
+  {
+    return NULL;
+  }
+  memset(pool, 0, sizeof(libwebsock_deflate_pool));
+  pool->allocator = lws_default_allocator;
+  pool->max_idle = DEFLATE_POOL_DEFAULT_IDLE;
+  if (options != NULL && options->max_idle > 0)
+  {
+    pool->max_idle = options->max_idle;
+  }
+  if (options != NULL && options->dictionary != NULL && options->dictionary_len > 0)
+  {
+    if (options->dictionary_len <= UINT_MAX)
+    {
+      pool->dictionary = (char *)pool->allocator.malloc_fn(pool->allocator.ctx, options->dictionary_len);
+    }
+    if (pool->dictionary == NULL)
+    {
+      libwebsock_deflate_pool_free(pool);
+      return NULL;
+    }
+    memcpy(pool->dictionary, options->dictionary, options->dictionary_len);
+    pool->dictionary_len = options->dictionary_len;
+    pool->dictionary_id = adler32(adler32(0L, Z_NULL, 0), (const Bytef *)pool->dictionary, pool->dictionary_len);
+  }
+  return pool;
+}
+
+//frees the pool; the connections using it must be destroyed first
+void libwebsock_deflate_pool_free(libwebsock_deflate_pool *pool)
+{
+  lws_zstream *s;
+  int inflating;
+
+  if (pool == NULL)
+  {
+    return;
+  }
+  for (inflating = 0; inflating < 2; inflating++)
+  {
+    while ((s = pool->idle[inflating]) != NULL)
+    {
+      pool->idle[inflating] = s->next;
+      if (inflating)
+      {
+        inflateEnd(&s->z);
+      }
+      else
+      {
+        deflateEnd(&s->z);
+      }
+      pool->allocator.free_fn(pool->allocator.ctx, s);
+    }
+  }
+  pool->allocator.free_fn(pool->allocator.ctx, pool->dictionary);
+  pool->allocator.free_fn(pool->allocator.ctx, pool->out);
+  pool->allocator.free_fn(pool->allocator.ctx, pool);
+}
+
+//bytes zlib currently holds for the pool's streams, lent out or idle
+size_t libwebsock_deflate_pool_memory(libwebsock_deflate_pool *pool)
+{
+  return pool->memory;
+}
+
+//whether an offer or response names a dictionary we don't have
+static int lws_deflate_dictionary_mismatch(libwebsock_deflate *ctx, lws_deflate_params *params)
+{
+  libwebsock_deflate_pool *pool = ctx->options.pool;
+
+  return params->dictionary &&
+         (pool == NULL || pool->dictionary == NULL || params->dictionary_id != pool->dictionary_id);
+}
+
+/*
+ * Server side: picks the first acceptable permessage-deflate offer in the
+ * client's Sec-WebSocket-Extensions value and writes the matching response
+ * parameters.  Returns 1 when one was accepted, 0 when none was.
+ */
+int lws_deflate_accept_offer(libwebsock_client_state *state, const char *value, char *response, size_t response_len)
+{
+  libwebsock_deflate *ctx = state->deflate;
+  lws_deflate_params offer;
+  const char *end;
+  int deflate_bits, inflate_bits, mem_level, len;
+
+  if (ctx == NULL)
+  {
+    return 0;
+  }
+
+  for (; *value != '\0'; value = *end != '\0' ? end + 1 : end)
+  {
+    end = strchr(value, ',');
+    if (end == NULL)
+    {
+      end = value + strlen(value);
+    }
+    //zlib can't compress with a 256 byte window
+    if (lws_deflate_parse(value, end, &offer) != 1 || offer.server_max_window_bits == 8 ||
+        lws_deflate_dictionary_mismatch(ctx, &offer))
+    {
+      continue;
+    }
+
+    deflate_bits = ctx->options.server_max_window_bits;
+    if (offer.server_max_window_bits > 0 && offer.server_max_window_bits < deflate_bits)
+    {
+      deflate_bits = offer.server_max_window_bits;
+    }
+    inflate_bits = DEFLATE_MAX_WINDOW_BITS;
+    if (offer.client_max_window_bits != 0)
+    {
+      inflate_bits = ctx->options.client_max_window_bits;
+      if (offer.client_max_window_bits > 0 && offer.client_max_window_bits < inflate_bits)
+      {
+        inflate_bits = offer.client_max_window_bits;
+      }
+    }
+    mem_level = ctx->options.mem_level;
+    if (lws_deflate_fit(ctx, &deflate_bits, &mem_level, &inflate_bits, offer.client_max_window_bits != 0) == -1)
+    {
+      logerror("permessage-deflate offer does not fit in %zu bytes", ctx->options.memory_limit);
+      continue;
+    }
+
+    ctx->deflate_bits = deflate_bits;
+    ctx->inflate_bits = inflate_bits;
+    ctx->mem_level = mem_level;
+    ctx->deflate_no_context_takeover = offer.server_no_context_takeover || ctx->options.server_no_context_takeover;
+    ctx->inflate_no_context_takeover = offer.client_no_context_takeover || ctx->options.client_no_context_takeover;
+    ctx->dictionary = offer.dictionary;
+
+    len = snprintf(response, response_len, "%s%s%s", DEFLATE_EXTENSION_NAME,
+                   ctx->deflate_no_context_takeover ? "; server_no_context_takeover" : "",
+                   ctx->inflate_no_context_takeover ? "; client_no_context_takeover" : "");
+    if (offer.server_max_window_bits > 0 || deflate_bits < DEFLATE_MAX_WINDOW_BITS)
+    {
+      len += snprintf(response + len, response_len - len, "; server_max_window_bits=%d", deflate_bits);
+    }
+    if (offer.client_max_window_bits > 0 || inflate_bits < DEFLATE_MAX_WINDOW_BITS)
+    {
+      len += snprintf(response + len, response_len - len, "; client_max_window_bits=%d", inflate_bits);
+    }
+    if (ctx->dictionary)
+    {
+      len += snprintf(response + len, response_len - len, "; %s=%lu", DEFLATE_DICTIONARY_PARAM, offer.dictionary_id);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Client side: writes the permessage-deflate offer for the upgrade request,
+ * first with the pool's dictionary if it has one and then without.
+ * Returns its length, or 0 if there is nothing to offer.
+ */
+int lws_deflate_make_offer(libwebsock_client_state *state, char *out, size_t out_len)
+{
+  libwebsock_deflate *ctx = state->deflate;
+  libwebsock_deflate_pool *pool;
+  char element[160];
+  int deflate_bits, inflate_bits, mem_level, len;
+
+  if (ctx == NULL)
+  {
+    return 0;
+  }
+
+  deflate_bits = ctx->options.client_max_window_bits;
+  inflate_bits = ctx->options.server_max_window_bits;
+  mem_level = ctx->options.mem_level;
+  if (lws_deflate_fit(ctx, &deflate_bits, &mem_level, &inflate_bits, 1) == -1)
+  {
+    logerror("permessage-deflate does not fit in %zu bytes", ctx->options.memory_limit);
+    return 0;
+  }
+  ctx->deflate_bits = deflate_bits;
+  ctx->inflate_bits = inflate_bits;
+  ctx->mem_level = mem_level;
+
+  len = snprintf(element, sizeof(element), "%s%s%s; client_max_window_bits", DEFLATE_EXTENSION_NAME,
+                 ctx->options.server_no_context_takeover ? "; server_no_context_takeover" : "",
+                 ctx->options.client_no_context_takeover ? "; client_no_context_takeover" : "");
+  if (deflate_bits < DEFLATE_MAX_WINDOW_BITS)
+  {
+    len += snprintf(element + len, sizeof(element) - len, "=%d", deflate_bits);
+  }
+  if (inflate_bits < DEFLATE_MAX_WINDOW_BITS)
+  {
+    len += snprintf(element + len, sizeof(element) - len, "; server_max_window_bits=%d", inflate_bits);
+  }
+
+  pool = ctx->options.pool;
+  if (pool != NULL && pool->dictionary != NULL)
+  {
+    len = snprintf(out, out_len, "%s; %s=%lu, %s", element, DEFLATE_DICTIONARY_PARAM, pool->dictionary_id, element);
+  }
+  else
+  {
+    len = snprintf(out, out_len, "%s", element);
+  }
+  return len < (int)out_len ? len : 0;
+}
+
+/*
+ * Client side: checks the server's Sec-WebSocket-Extensions value against
+ * our offer and settles the parameters.  Returns -1 if it can't be used.
+ */
+int lws_deflate_accept_response(libwebsock_client_state *state, const char *value)
+{
+  libwebsock_deflate *ctx = state->deflate;
+  lws_deflate_params response;
+
+  if (ctx == NULL || (state->flags & STATE_DEFLATE) || strchr(value, ',') != NULL ||
+      lws_deflate_parse(value, value + strlen(value), &response) != 1)
+  {
+    return -1;
+  }
+  if (response.server_max_window_bits > ctx->inflate_bits || response.client_max_window_bits == -1 ||
+      response.client_max_window_bits == 8 || lws_deflate_dictionary_mismatch(ctx, &response))
+  {
+    return -1;
+  }
+  //pooled streams can't keep the server's window between messages
+  if (ctx->options.pool != NULL && !response.server_no_context_takeover)
+  {
+    return -1;
+  }
+
+  if (response.server_max_window_bits > 0)
+  {
+    ctx->inflate_bits = response.server_max_window_bits;
+  }
+  if (response.client_max_window_bits > 0 && response.client_max_window_bits < ctx->deflate_bits)
+  {
+    ctx->deflate_bits = response.client_max_window_bits;
+  }
+  ctx->deflate_no_context_takeover = response.client_no_context_takeover || ctx->options.client_no_context_takeover;
+  ctx->inflate_no_context_takeover = response.server_no_context_takeover;
+  ctx->dictionary = response.dictionary;
+  return 0;
+}
+
+//whether a frame with these flags is sent compressed
+int lws_deflate_wants(libwebsock_client_state *state, size_t len, int flags)
+{
+  int opcode = flags & 0x0f;
+
+  return (state->flags & STATE_DEFLATE) && (flags & WS_FRAGMENT_FIN) &&
+         (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) && len > 0 &&
+         len >= state->deflate->options.min_length && len <= UINT_MAX;
+}
+
+//sets up a stream allocating through the pool, or the state when pool is NULL
+static lws_zstream *lws_zstream_new(libwebsock_client_state *state, libwebsock_deflate_pool *pool,
+                                    libwebsock_deflate *ctx, int inflating)
+{
+  lws_zstream *s;
+  int ret;
+
+  if (pool != NULL)
+  {
+    s = (lws_zstream *)pool->allocator.malloc_fn(pool->allocator.ctx, sizeof(lws_zstream));
+  }
+  else
+  {
+    s = (lws_zstream *)lws_state_malloc(state, sizeof(lws_zstream));
+  }
+  if (s == NULL)
+  {
+    return NULL;
+  }
+  memset(s, 0, sizeof(lws_zstream));
+  s->bits = inflating ? ctx->inflate_bits : ctx->deflate_bits;
+  s->level = ctx->options.level;
+  s->mem_level = ctx->mem_level;
+  s->z.zalloc = pool != NULL ? lws_pool_zalloc : lws_deflate_zalloc;
+  s->z.zfree = pool != NULL ? lws_pool_zfree : lws_deflate_zfree;
+  s->z.opaque = pool != NULL ? (voidpf)s : (voidpf)state;
+  s->pool = pool;
+  s->owner = pool != NULL ? ctx : NULL;
+  s->z.next_in = Z_NULL;
+  s->z.avail_in = 0;
+  if (inflating)
+  {
+    ret = inflateInit2(&s->z, -s->bits);
+  }
+  else
+  {
+    ret = deflateInit2(&s->z, s->level, Z_DEFLATED, -s->bits, s->mem_level, Z_DEFAULT_STRATEGY);
+  }
+  if (ret != Z_OK)
+  {
+    logerror("unable to set up the %s", inflating ? "decompressor" : "compressor");
+    if (pool != NULL)
+    {
+      pool->allocator.free_fn(pool->allocator.ctx, s);
+    }
+    else
+    {
+      lws_state_free(state, s);
+    }
+    return NULL;
+  }
+  return s;
+}
+
+static void lws_zstream_free(libwebsock_client_state *state, libwebsock_deflate_pool *pool, lws_zstream *s,
+                             int inflating)
+{
+  if (inflating)
+  {
+    inflateEnd(&s->z);
+  }
+  else
+  {
+    deflateEnd(&s->z);
+  }
+  if (pool != NULL)
+  {
+    pool->allocator.free_fn(pool->allocator.ctx, s);
+  }
+  else
+  {
+    lws_state_free(state, s);
+  }
+}
+
+//takes an idle stream the connection can use out of the pool, if there is one
+static lws_zstream *lws_pool_take(libwebsock_deflate_pool *pool, libwebsock_deflate *ctx, int inflating)
+{
+  lws_zstream **link, *s;
+
+  //a compressor's window and level are fixed once set up, an inflater's window is set on reset
+  for (link = &pool->idle[inflating]; *link != NULL; link = &(*link)->next)
+  {
+    s = *link;
+    if (ctx->options.memory_limit > 0 && ctx->memory + s->memory > ctx->options.memory_limit)
+    {
+      continue;
+    }
+    if (inflating || (s->bits == ctx->deflate_bits && s->level == ctx->options.level &&
+                      s->mem_level == ctx->mem_level))
+    {
+      *link = s->next;
+      pool->idle_count[inflating]--;
+      s->owner = ctx;
+      ctx->memory += s->memory;
+      if (inflating && s->bits != ctx->inflate_bits)
+      {
+        inflateReset2(&s->z, -ctx->inflate_bits);
+        s->bits = ctx->inflate_bits;
+      }
+      return s;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Gets the stream for one direction of the connection: its own, set up on
+ * first use, or one borrowed from the pool until lws_zstream_done.  A
+ * borrowed stream is primed with the dictionary when one was agreed.
+ */
+static z_stream *lws_zstream_get(libwebsock_client_state *state, libwebsock_deflate *ctx, int inflating)
+{
+  libwebsock_deflate_pool *pool = ctx->options.pool;
+  lws_zstream *s = ctx->stream[inflating];
+  int ret;
+
+  if (s != NULL)
+  {
+    return &s->z;
+  }
+  if (pool != NULL)
+  {
+    s = lws_pool_take(pool, ctx, inflating);
+  }
+  if (s == NULL)
+  {
+    s = lws_zstream_new(state, pool, ctx, inflating);
+    if (s == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  if (ctx->dictionary)
+  {
+    if (inflating)
+    {
+      ret = inflateSetDictionary(&s->z, (const Bytef *)pool->dictionary, pool->dictionary_len);
+    }
+    else
+    {
+      ret = deflateSetDictionary(&s->z, (const Bytef *)pool->dictionary, pool->dictionary_len);
+    }
+    if (ret != Z_OK)
+    {
+      logerror("unable to load the compression dictionary");
+      lws_zstream_free(state, pool, s, inflating);
+      return NULL;
+    }
+  }
+  ctx->stream[inflating] = s;
+  return &s->z;
+}
+
+/*
+ * Done with a message in one direction.  The connection's own stream is
+ * reset when asked to; a borrowed one always is and goes back to the pool,
+ * or is freed if the pool already holds max_idle.
+ */
+static void lws_zstream_done(libwebsock_client_state *state, libwebsock_deflate *ctx, int inflating, int reset)
+{
+  libwebsock_deflate_pool *pool = ctx->options.pool;
+  lws_zstream *s = ctx->stream[inflating];
+
+  if (s == NULL || (pool == NULL && !reset))
+  {
+    return;
+  }
+  if (inflating)
+  {
+    inflateReset(&s->z);
+  }
+  else
+  {
+    deflateReset(&s->z);
+  }
+  if (pool == NULL)
+  {
+    return;
+  }
+
+  ctx->stream[inflating] = NULL;
+  ctx->memory -= s->memory;
+  s->owner = NULL;
+  if (pool->idle_count[inflating] >= pool->max_idle)
+  {
+    lws_zstream_free(state, pool, s, inflating);
+    return;
+  }
+  s->next = pool->idle[inflating];
+  pool->idle[inflating] = s;
+  pool->idle_count[inflating]++;
+}
+
+/*
+ * Compresses a whole message and queues it as one frame with RSV1 set.  If
+ * it can't be queued the stream is reset, so the peer never has to resolve
+ * references into bytes it didn't get.  Pooled connections compress into
+ * the pool's buffer, being done with it before returning.
+ */
+ssize_t lws_deflate_queue_message(libwebsock_client_state *state, const char *data, size_t len, int flags)
+{
+  libwebsock_deflate *ctx = state->deflate;
+  libwebsock_deflate_pool *pool = ctx->options.pool;
+  char **out = pool != NULL ? &pool->out : &ctx->out;
+  size_t *out_sz = pool != NULL ? &pool->out_sz : &ctx->out_sz;
+  z_stream *z;
+  size_t out_len = 0, new_sz;
+  char *new_out;
+  ssize_t retval;
+  int ret;
+
+  z = lws_zstream_get(state, ctx, LWS_ZSTREAM_DEFLATE);
+  if (z == NULL)
+  {
+    return -1;
+  }
+
+  z->next_in = (Bytef *)data;
+  z->avail_in = len;
+  do
+  {
+    if (out_len == *out_sz)
+    {
+      new_sz = *out_sz > 0 ? *out_sz << 1 : deflateBound(z, len) + 16;
+      new_out = NULL;
+      if (new_sz <= UINT_MAX)
+      {
+        new_out = pool != NULL ? (char *)pool->allocator.realloc_fn(pool->allocator.ctx, *out, new_sz)
+                               : (char *)lws_state_realloc(state, *out, new_sz);
+      }
+      if (new_out == NULL)
+      {
+        logerror("unable to grow the compression buffer");
+        lws_zstream_done(state, ctx, LWS_ZSTREAM_DEFLATE, 1);
+        return -1;
+      }
+      *out = new_out;
+      *out_sz = new_sz;
+    }
+    z->next_out = (Bytef *)*out + out_len;
+    z->avail_out = *out_sz - out_len;
+    ret = deflate(z, Z_SYNC_FLUSH);
+    out_len = (char *)z->next_out - *out;
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+      logerror("compression failed: %s", z->msg != NULL ? z->msg : "unknown error");
+      lws_zstream_done(state, ctx, LWS_ZSTREAM_DEFLATE, 1);
+      return -1;
+    }
+  } while (z->avail_out == 0);
+
+  //the sync flush ends in 00 00 ff ff, which the receiver adds back
+  retval = lws_output_queue_copy(state, *out, out_len - 4, flags | WS_FRAGMENT_RSV1);
+  lws_zstream_done(state, ctx, LWS_ZSTREAM_DEFLATE, retval == -1 || ctx->deflate_no_context_takeover);
+
+  if (*out_sz > FRAME_POOL_MAX_RAWDATA)
+  {
+    if (pool != NULL)
+    {
+      pool->allocator.free_fn(pool->allocator.ctx, *out);
+    }
+    else
+    {
+      lws_state_free(state, *out);
+    }
+    *out = NULL;
+    *out_sz = 0;
+  }
+  return retval;
+}
+
+/*
+ * Inflates a compressed message into a buffer the state keeps, NUL
+ * terminated, and points out at it.  Returns 0 or the close code to fail
+ * the connection with: 1007 for corrupt data, 1009 once the output passes
+ * max_message_size and 1011 when out of memory.
+ */
+unsigned short lws_inflate_message(libwebsock_client_state *state, const char *data, size_t len, char **out,
+                                   size_t *out_len)
+{
+  static const char tail[4] = {0x00, 0x00, (char)0xff, (char)0xff};
+  libwebsock_deflate *ctx = state->deflate;
+  z_stream *z;
+  size_t total = 0, new_sz;
+  char *new_in;
+  int ret = Z_OK, pass;
+
+  if (len > UINT_MAX)
+  {
+    return WS_CLOSE_MESSAGE_TOO_BIG;
+  }
+  z = lws_zstream_get(state, ctx, LWS_ZSTREAM_INFLATE);
+  if (z == NULL)
+  {
+    return WS_CLOSE_UNEXPECTED_ERROR;
+  }
+
+  for (pass = 0; pass < 2 && ret != Z_STREAM_END; pass++)
+  {
+    z->next_in = (Bytef *)(pass == 0 ? data : tail);
+    z->avail_in = pass == 0 ? len : sizeof(tail);
+    do
+    {
+      if (total + 1 >= ctx->in_sz)
+      {
+        new_sz = ctx->in_sz > 0 ? ctx->in_sz << 1 : FRAME_CHUNK_LENGTH;
+        new_in = new_sz <= UINT_MAX ? (char *)lws_message_realloc(state, ctx->in, new_sz) : NULL;
+        if (new_in == NULL)
+        {
+          lws_zstream_done(state, ctx, LWS_ZSTREAM_INFLATE, 1);
+          return WS_CLOSE_UNEXPECTED_ERROR;
+        }
+        ctx->in = new_in;
+        ctx->in_sz = new_sz;
+      }
+      z->next_out = (Bytef *)ctx->in + total;
+      z->avail_out = ctx->in_sz - total - 1;
+      ret = inflate(z, Z_SYNC_FLUSH);
+      total = (char *)z->next_out - ctx->in;
+      if (ret == Z_MEM_ERROR)
+      {
+        lws_zstream_done(state, ctx, LWS_ZSTREAM_INFLATE, 1);
+        return WS_CLOSE_UNEXPECTED_ERROR;
+      }
+      if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END)
+      {
+        logerror("decompression failed: %s", z->msg != NULL ? z->msg : "unknown error");
+        lws_zstream_done(state, ctx, LWS_ZSTREAM_INFLATE, 1);
+        return WS_CLOSE_WRONG_TYPE;
+      }
+      if (state->max_message_size > 0 && total > state->max_message_size)
+      {
+        lws_zstream_done(state, ctx, LWS_ZSTREAM_INFLATE, 1);
+        return WS_CLOSE_MESSAGE_TOO_BIG;
+      }
+    } while (ret != Z_STREAM_END && z->avail_out == 0);
+  }
+
+  //a sender that ended with a final block starts afresh next message
+  lws_zstream_done(state, ctx, LWS_ZSTREAM_INFLATE, ret == Z_STREAM_END || ctx->inflate_no_context_takeover);
+  ctx->in[total] = '\0';
+  *out = ctx->in;
+  *out_len = total;
+  return 0;
+}
+
+//hands the last inflated message's buffer over to the caller
+char *lws_inflate_detach(libwebsock_client_state *state)
+{
+  char *in = state->deflate->in;
+
+  state->deflate->in = NULL;
+  state->deflate->in_sz = 0;
+  return in;
+}
+
+//keeps a modest inflate buffer around for the next message, none when pooled
+void lws_inflate_trim(libwebsock_client_state *state)
+{
+  if (state->deflate->in_sz > FRAME_POOL_MAX_RAWDATA || state->deflate->options.pool != NULL)
+  {
+    lws_inflate_release(state);
+  }
+}
+
+void lws_inflate_release(libwebsock_client_state *state)
+{
+  lws_message_free(state, state->deflate->in);
+  state->deflate->in = NULL;
+  state->deflate->in_sz = 0;
+}
+
+void lws_deflate_free(libwebsock_client_state *state)
+{
+  libwebsock_deflate *ctx = state->deflate;
+  int inflating;
+
+  if (ctx == NULL)
+  {
+    return;
+  }
+  for (inflating = 0; inflating < 2; inflating++)
+  {
+    if (ctx->stream[inflating] != NULL)
+    {
+      lws_zstream_free(state, ctx->options.pool, ctx->stream[inflating], inflating);
+    }
+  }
+  lws_state_free(state, ctx->out);
+  lws_message_free(state, ctx->in);
+  lws_state_free(state, ctx);
+  state->deflate = NULL;
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef DEFLATE_H_
+#define DEFLATE_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include "types.h"
+
+#define DEFLATE_EXTENSION_NAME "permessage-deflate"
+
+int libwebsock_enable_deflate(libwebsock_client_state *state, const libwebsock_deflate_options *options);
+size_t libwebsock_deflate_memory(libwebsock_client_state *state);
+libwebsock_deflate_pool *libwebsock_deflate_pool_new(const libwebsock_deflate_pool_options *options);
+void libwebsock_deflate_pool_free(libwebsock_deflate_pool *pool);
+size_t libwebsock_deflate_pool_memory(libwebsock_deflate_pool *pool);
+
+int lws_deflate_accept_offer(libwebsock_client_state *state, const char *value, char *response, size_t response_len);
+int lws_deflate_make_offer(libwebsock_client_state *state, char *out, size_t out_len);
+int lws_deflate_accept_response(libwebsock_client_state *state, const char *value);
+int lws_deflate_wants(libwebsock_client_state *state, size_t len, int flags);
+ssize_t lws_deflate_queue_message(libwebsock_client_state *state, const char *data, size_t len, int flags);
+unsigned short lws_inflate_message(libwebsock_client_state *state, const char *data, size_t len, char **out, size_t *out_len);
+char *lws_inflate_detach(libwebsock_client_state *state);
+void lws_inflate_trim(libwebsock_client_state *state);
+void lws_inflate_release(libwebsock_client_state *state);
+void lws_deflate_free(libwebsock_client_state *state);
+#endif /* DEFLATE_H_ */
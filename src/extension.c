@@ -0,0 +1,424 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "websock.h"
+#include "logger.h"
+
+/*
+ * Extensions added to a connection are kept in an array; the ones agreed
+ * on in the handshake are moved to the front in the order they were
+ * negotiated, which is the order they encode in and the reverse of the
+ * order they decode in.  extension_rsv collects the RSV bits claimed by
+ * everything in use, permessage-deflate included, and is what the frame
+ * parser lets through on a message's first frame.
+ */
+
+#define EXTENSION_PARAMS_LENGTH 256
+#define EXTENSION_RSV_BITS (WS_FRAGMENT_RSV1 | WS_FRAGMENT_RSV2 | WS_FRAGMENT_RSV3)
+
+typedef struct _libwebsock_extension_slot
+{
+  const libwebsock_extension *ext;
+  void *arg;
+  int offered;
+} libwebsock_extension_slot;
+
+/*
+ * Finds the element of a Sec-WebSocket-Extensions value starting at s and
+ * points name and name_end at its name.  Returns where the element ends.
+ */
+static const char *lws_extension_element(const char *s, const char **name, const char **name_end)
+{
+  const char *end = strchr(s, ',');
+  const char *params;
+
+  if (end == NULL)
+  {
+    end = s + strlen(s);
+  }
+  params = memchr(s, ';', end - s);
+  *name = s;
+  *name_end = params != NULL ? params : end;
+  while (*name < *name_end && (**name == ' ' || **name == '\t'))
+  {
+    (*name)++;
+  }
+  while (*name_end > *name && ((*name_end)[-1] == ' ' || (*name_end)[-1] == '\t'))
+  {
+    (*name_end)--;
+  }
+  return end;
+}
+
+static int lws_extension_name_is(const char *name, const char *name_end, const char *ext_name)
+{
+  return (size_t)(name_end - name) == strlen(ext_name) && strncasecmp(name, ext_name, name_end - name) == 0;
+}
+
+//copies the text from start to end into out, returns -1 if it doesn't fit
+static int lws_extension_copy(const char *start, const char *end, char *out, size_t out_len)
+{
+  if ((size_t)(end - start) >= out_len)
+  {
+    return -1;
+  }
+  memcpy(out, start, end - start);
+  out[end - start] = '\0';
+  return 0;
+}
+
+//marks the extension at index i as in use, after the ones already agreed on
+static void lws_extension_activate(libwebsock_client_state *state, unsigned int i)
+{
+  libwebsock_extension_slot slot = state->extensions[i];
+
+  state->extensions[i] = state->extensions[state->extensions_active];
+  state->extensions[state->extensions_active++] = slot;
+  state->extension_rsv |= slot.ext->rsv;
+}
+
+/*
+ * Lets the connection negotiate ext in its opening handshake; arg is
+ * passed to its callbacks.  Extensions are offered, and taken when the
+ * server, in the order they were added.  Returns -1 if ext claims no RSV
+ * bits or any other bits, is already added, or the handshake is done.
+ */
+int libwebsock_add_extension(libwebsock_client_state *state, const libwebsock_extension *ext, void *arg)
+{
+  libwebsock_extension_slot *slots;
+  unsigned int i;
+
+  if (ext->name == NULL || ext->name[0] == '\0' || (ext->rsv & EXTENSION_RSV_BITS) == 0 ||
+      (ext->rsv & ~EXTENSION_RSV_BITS) != 0 || strcasecmp(ext->name, DEFLATE_EXTENSION_NAME) == 0)
+  {
+    logerror("invalid extension");
+    return -1;
+  }
+  if (state->flags & STATE_CONNECTED)
+  {
+    logerror("extensions must be added before the handshake");
+    return -1;
+  }
+  for (i = 0; i < state->extensions_count; i++)
+  {
+    if (strcasecmp(state->extensions[i].ext->name, ext->name) == 0)
+    {
+      logerror("extension %s is already added", ext->name);
+      return -1;
+    }
+  }
+
+  slots = (libwebsock_extension_slot *)lws_state_realloc(state, state->extensions,
+                                                          (state->extensions_count + 1) * sizeof(libwebsock_extension_slot));
+  if (slots == NULL)
+  {
+    return -1;
+  }
+  slots[state->extensions_count].ext = ext;
+  slots[state->extensions_count].arg = arg;
+  slots[state->extensions_count].offered = 0;
+  state->extensions = slots;
+  state->extensions_count++;
+  return 0;
+}
+
+/*
+ * Server side: takes, for each extension in turn, the first offer for it
+ * in the client's Sec-WebSocket-Extensions value that it accepts and whose
+ * RSV bits are still free, then permessage-deflate if RSV1 is.  Writes the
+ * response value and returns its length, 0 when nothing was taken.
+ */
+int lws_extension_accept_offers(libwebsock_client_state *state, const char *value, char *response, size_t response_len)
+{
+  libwebsock_extension_slot *slot;
+  const char *s, *end, *name, *name_end;
+  char params[EXTENSION_PARAMS_LENGTH];
+  char ext_response[EXTENSION_PARAMS_LENGTH];
+  size_t len = 0;
+  unsigned int i;
+  int n;
+
+  response[0] = '\0';
+  for (i = 0; i < state->extensions_count; i++)
+  {
+    slot = &state->extensions[i];
+    for (s = value; *s != '\0'; s = *end != '\0' ? end + 1 : end)
+    {
+      end = lws_extension_element(s, &name, &name_end);
+      if (!lws_extension_name_is(name, name_end, slot->ext->name) || (slot->ext->rsv & state->extension_rsv) != 0 ||
+          lws_extension_copy(name_end, end, params, sizeof(params)) == -1)
+      {
+        continue;
+      }
+      ext_response[0] = '\0';
+      if (slot->ext->accept_offer != NULL &&
+          slot->ext->accept_offer(state, slot->arg, params, ext_response, sizeof(ext_response)) != 1)
+      {
+        continue;
+      }
+
+      n = snprintf(response + len, response_len - len, "%s%s%s", len > 0 ? ", " : "", slot->ext->name, ext_response);
+      if (n < 0 || (size_t)n >= response_len - len)
+      {
+        logerror("response for extension %s is too long", slot->ext->name);
+        response[len] = '\0';
+        break;
+      }
+      len += n;
+      lws_extension_activate(state, i);
+      break;
+    }
+  }
+
+  if ((state->extension_rsv & WS_FRAGMENT_RSV1) == 0 &&
+      lws_deflate_accept_offer(state, value, ext_response, sizeof(ext_response)))
+  {
+    n = snprintf(response + len, response_len - len, "%s%s", len > 0 ? ", " : "", ext_response);
+    if (n >= 0 && (size_t)n < response_len - len)
+    {
+      len += n;
+      state->flags |= STATE_DEFLATE;
+      state->extension_rsv |= WS_FRAGMENT_RSV1;
+    }
+    else
+    {
+      response[len] = '\0';
+    }
+  }
+  return len;
+}
+
+/*
+ * Client side: writes the offers for the upgrade request, every added
+ * extension in turn and permessage-deflate last.  Returns the length of
+ * the value, 0 if there is nothing to offer.
+ */
+int lws_extension_make_offers(libwebsock_client_state *state, char *out, size_t out_len)
+{
+  libwebsock_extension_slot *slot;
+  char params[EXTENSION_PARAMS_LENGTH];
+  char deflate_offer[512];
+  size_t len = 0;
+  unsigned int i;
+  int n;
+
+  out[0] = '\0';
+  for (i = 0; i < state->extensions_count; i++)
+  {
+    slot = &state->extensions[i];
+    params[0] = '\0';
+    slot->offered = 0;
+    if (slot->ext->make_offer != NULL && slot->ext->make_offer(state, slot->arg, params, sizeof(params)) < 0)
+    {
+      continue;
+    }
+    n = snprintf(out + len, out_len - len, "%s%s%s", len > 0 ? ", " : "", slot->ext->name, params);
+    if (n < 0 || (size_t)n >= out_len - len)
+    {
+      logerror("offer for extension %s is too long", slot->ext->name);
+      out[len] = '\0';
+      return len;
+    }
+    len += n;
+    slot->offered = 1;
+  }
+
+  if (lws_deflate_make_offer(state, deflate_offer, sizeof(deflate_offer)) > 0)
+  {
+    n = snprintf(out + len, out_len - len, "%s%s", len > 0 ? ", " : "", deflate_offer);
+    if (n >= 0 && (size_t)n < out_len - len)
+    {
+      len += n;
+    }
+    else
+    {
+      out[len] = '\0';
+    }
+  }
+  return len;
+}
+
+/*
+ * Client side: settles every extension the server picked in one
+ * Sec-WebSocket-Extensions value.  Returns -1 if it picked one we didn't
+ * offer, picked one twice, or its parameters can't be used.
+ */
+int lws_extension_accept_response(libwebsock_client_state *state, const char *value)
+{
+  libwebsock_extension_slot *slot;
+  const char *s, *end, *name, *name_end;
+  char element[EXTENSION_PARAMS_LENGTH];
+  unsigned int i;
+
+  for (s = value; *s != '\0'; s = *end != '\0' ? end + 1 : end)
+  {
+    end = lws_extension_element(s, &name, &name_end);
+    if (name == name_end)
+    {
+      continue;
+    }
+
+    if (lws_extension_name_is(name, name_end, DEFLATE_EXTENSION_NAME))
+    {
+      if ((state->extension_rsv & WS_FRAGMENT_RSV1) != 0 || lws_extension_copy(s, end, element, sizeof(element)) == -1 ||
+          lws_deflate_accept_response(state, element) == -1)
+      {
+        return -1;
+      }
+      state->flags |= STATE_DEFLATE;
+      state->extension_rsv |= WS_FRAGMENT_RSV1;
+      continue;
+    }
+
+    for (i = state->extensions_active; i < state->extensions_count; i++)
+    {
+      if (state->extensions[i].offered && lws_extension_name_is(name, name_end, state->extensions[i].ext->name))
+      {
+        break;
+      }
+    }
+    if (i == state->extensions_count)
+    {
+      logerror("server picked an extension that was not offered");
+      return -1;
+    }
+    slot = &state->extensions[i];
+    if ((slot->ext->rsv & state->extension_rsv) != 0 || lws_extension_copy(name_end, end, element, sizeof(element)) == -1)
+    {
+      return -1;
+    }
+    if (slot->ext->accept_response != NULL && slot->ext->accept_response(state, slot->arg, element) == -1)
+    {
+      return -1;
+    }
+    lws_extension_activate(state, i);
+  }
+  return 0;
+}
+
+//whether a message sent now would go through an extension's encode
+int lws_extension_encodes(libwebsock_client_state *state)
+{
+  unsigned int i;
+
+  for (i = 0; i < state->extensions_active; i++)
+  {
+    if (state->extensions[i].ext->encode != NULL)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Passes a whole data message to be sent through the extensions in use,
+ * moving data and len on to each one's output.  Returns the RSV bits to
+ * send it with, or -1 if an extension failed.
+ */
+int lws_extension_encode(libwebsock_client_state *state, const char **data, size_t *len, int flags)
+{
+  libwebsock_extension_slot *slot;
+  unsigned int opcode = flags & 0x0f, i;
+  const char *out;
+  size_t out_len;
+  int rsv = 0, retval;
+
+  if (state->extensions_active == 0 || (flags & WS_FRAGMENT_FIN) == 0 ||
+      (opcode != WS_OPCODE_TEXT && opcode != WS_OPCODE_BINARY))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < state->extensions_active; i++)
+  {
+    slot = &state->extensions[i];
+    if (slot->ext->encode == NULL)
+    {
+      continue;
+    }
+    retval = slot->ext->encode(state, slot->arg, opcode, *data, *len, &out, &out_len);
+    if (retval == -1)
+    {
+      logerror("extension %s failed to encode a message", slot->ext->name);
+      return -1;
+    }
+    if (retval != 0)
+    {
+      rsv |= retval & slot->ext->rsv;
+      *data = out;
+      *len = out_len;
+    }
+  }
+  return rsv;
+}
+
+/*
+ * Passes a received message through the extensions whose bits are set in
+ * rsv, last negotiated first.  Returns 0 or the close code one of them
+ * failed with.
+ */
+unsigned short lws_extension_decode(libwebsock_client_state *state, unsigned int opcode, unsigned int rsv, char **data,
+                                    size_t *len)
+{
+  libwebsock_extension_slot *slot;
+  unsigned short close_code;
+  unsigned int i;
+  char *out;
+  size_t out_len;
+
+  for (i = state->extensions_active; i-- > 0;)
+  {
+    slot = &state->extensions[i];
+    if ((rsv & slot->ext->rsv) == 0 || slot->ext->decode == NULL)
+    {
+      continue;
+    }
+    close_code = slot->ext->decode(state, slot->arg, opcode, rsv & slot->ext->rsv, *data, *len, &out, &out_len);
+    if (close_code != 0)
+    {
+      logerror("extension %s failed to decode a message", slot->ext->name);
+      return close_code;
+    }
+    *data = out;
+    *len = out_len;
+  }
+  return 0;
+}
+
+void lws_extension_free(libwebsock_client_state *state)
+{
+  unsigned int i;
+
+  for (i = 0; i < state->extensions_count; i++)
+  {
+    if (state->extensions[i].ext->release != NULL)
+    {
+      state->extensions[i].ext->release(state, state->extensions[i].arg);
+    }
+  }
+  lws_state_free(state, state->extensions);
+  state->extensions = NULL;
+  state->extensions_count = 0;
+  state->extensions_active = 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef EXTENSION_H_
+#define EXTENSION_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include "types.h"
+
+int libwebsock_add_extension(libwebsock_client_state *state, const libwebsock_extension *ext, void *arg);
+
+int lws_extension_accept_offers(libwebsock_client_state *state, const char *value, char *response, size_t response_len);
+int lws_extension_make_offers(libwebsock_client_state *state, char *out, size_t out_len);
+int lws_extension_accept_response(libwebsock_client_state *state, const char *value);
+int lws_extension_encodes(libwebsock_client_state *state);
+int lws_extension_encode(libwebsock_client_state *state, const char **data, size_t *len, int flags);
+unsigned short lws_extension_decode(libwebsock_client_state *state, unsigned int opcode, unsigned int rsv, char **data, size_t *len);
+void lws_extension_free(libwebsock_client_state *state);
+#endif /* EXTENSION_H_ */
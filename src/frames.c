@@ -23,22 +23,149 @@
 #include "websock.h"
 #include "logger.h"
 
+/*
+ * Frames and their rawdata buffers are recycled through a small per-connection
+ * free list, so steady traffic doesn't go back to the allocator per message.
+ * Frames whose rawdata grew past FRAME_POOL_MAX_RAWDATA are not kept.
+ */
+libwebsock_frame *libwebsock_new_frame(libwebsock_client_state *state)
+{
+  libwebsock_frame *frame = state->free_frames;
+  char *rawdata;
+  size_t rawdata_sz;
+
+  if (frame != NULL)
+  {
+    state->free_frames = frame->next_frame;
+    state->free_frames_count--;
+    rawdata = frame->rawdata;
+    rawdata_sz = frame->rawdata_sz;
+    memset(frame, 0, sizeof(libwebsock_frame));
+    frame->rawdata = rawdata;
+    frame->rawdata_sz = rawdata_sz;
+  }
+  else
+  {
+    frame = (libwebsock_frame *)lws_state_calloc(state, sizeof(libwebsock_frame));
+    if (frame == NULL)
+    {
+      return NULL;
+    }
+    frame->rawdata = (char *)lws_state_malloc(state, FRAME_CHUNK_LENGTH);
+    if (frame->rawdata == NULL)
+    {
+      lws_state_free(state, frame);
+      return NULL;
+    }
+    frame->rawdata_sz = FRAME_CHUNK_LENGTH;
+  }
+
+  frame->payload_len = -1;
+  return frame;
+}
+
+static void libwebsock_release_frame(libwebsock_client_state *state, libwebsock_frame *frame)
+{
+  if (state->free_frames_count < FRAME_POOL_SIZE && frame->rawdata != NULL &&
+      frame->rawdata_sz <= FRAME_POOL_MAX_RAWDATA)
+  {
+    frame->next_frame = state->free_frames;
+    state->free_frames = frame;
+    state->free_frames_count++;
+    return;
+  }
+
+  lws_state_free(state, frame->rawdata);
+  lws_state_free(state, frame);
+}
+
 int libwebsock_fail_and_cleanup(libwebsock_client_state *state)
 {
   state->flags |= STATE_SHOULD_CLOSE;
   return libwebsock_error(state, WS_CLOSE_PROTOCOL_ERROR);
 }
 
+int libwebsock_fail_no_memory(libwebsock_client_state *state)
+{
+  logerror("out of memory");
+  state->flags |= STATE_SHOULD_CLOSE;
+  return libwebsock_error(state, WS_CLOSE_UNEXPECTED_ERROR);
+}
+
+/*
+ * Unmasks the payload of a completed data frame onto the end of the message
+ * reassembly buffer, growing it geometrically.  A frame arriving while no
+ * fragment is in progress starts a new message.  Text is validated as it is
+ * copied.  Returns 0, or the close code to fail the connection with: 1007 as
+ * soon as the message can no longer be valid UTF-8, 1011 if the buffer can't
+ * be grown.
+ */
+int libwebsock_append_fragment(libwebsock_client_state *state, libwebsock_frame *frame)
+{
+  size_t needed, new_sz;
+  char *payload = frame->rawdata + frame->payload_offset;
+  char *dst, *new_data;
+
+  if ((state->flags & STATE_RECEIVING_FRAGMENT) == 0)
+  {
+    state->message_rsv = frame->rsv;
+    state->message_opcode = frame->opcode;
+    state->message_utf8_state = UTF8_ACCEPT;
+    state->message_len = 0;
+  }
+
+  needed = state->message_len + frame->payload_len + 1;
+  if (needed > state->message_sz)
+  {
+    new_sz = state->message_sz > 0 ? state->message_sz : FRAME_CHUNK_LENGTH;
+    while (new_sz < needed)
+    {
+      new_sz <<= 1;
+    }
+    new_data = (char *)lws_message_realloc(state, state->message_data, new_sz);
+    if (new_data == NULL)
+    {
+      return WS_CLOSE_UNEXPECTED_ERROR;
+    }
+    state->message_data = new_data;
+    state->message_sz = new_sz;
+  }
+
+  dst = state->message_data + state->message_len;
+  //text an extension transformed is validated once decoded
+  if (state->message_opcode == WS_OPCODE_TEXT && state->message_rsv == 0)
+  {
+    state->message_utf8_state = lws_unmask_utf8(dst, payload, frame->payload_len, frame->mask, 0, state->message_utf8_state);
+  }
+  else
+  {
+    lws_unmask(dst, payload, frame->payload_len, frame->mask, 0);
+  }
+  state->message_len += frame->payload_len;
+
+  return state->message_utf8_state == UTF8_REJECT ? WS_CLOSE_WRONG_TYPE : 0;
+}
+
 int libwebsock_new_continuation_frame(libwebsock_client_state *state)
 {
-  logdebug("creating continuation frame");
+  logdebug("appending fragment to message");
   libwebsock_frame *current = state->current_frame;
-  libwebsock_frame *new = (libwebsock_frame *)lws_calloc(sizeof(libwebsock_frame));
-  new->rawdata = (char *)lws_malloc(FRAME_CHUNK_LENGTH);
-  new->rawdata_sz = FRAME_CHUNK_LENGTH;
-  new->prev_frame = current;
-  current->next_frame = new;
-  state->current_frame = new;
+  unsigned short code;
+
+  code = libwebsock_append_fragment(state, current);
+  if (code == WS_CLOSE_UNEXPECTED_ERROR)
+  {
+    return libwebsock_fail_no_memory(state);
+  }
+  else if (code != 0)
+  {
+    logerror("Error validating UTF-8 sequence.");
+    return libwebsock_error(state, code);
+  }
+
+  //the payload now lives in the message buffer, reuse the frame for the next fragment
+  current->state = sw_start;
+  current->rawdata_idx = 0;
   state->flags |= STATE_RECEIVING_FRAGMENT;
   return 0;
 }
@@ -57,15 +184,26 @@ void libwebsock_free_all_frames(libwebsock_client_state *state)
       while (current != NULL)
       {
         next = current->next_frame;
-        if (current->rawdata)
-        {
-          lws_free(current->rawdata);
-        }
-
-        lws_free(current);
+        lws_state_free(state, current->rawdata);
+        lws_state_free(state, current);
         current = next;
       }
     }
+
+    for (current = state->free_frames; current != NULL; current = next)
+    {
+      next = current->next_frame;
+      lws_state_free(state, current->rawdata);
+      lws_state_free(state, current);
+    }
+    state->free_frames = NULL;
+    state->free_frames_count = 0;
+
+    //partially reassembled message goes with its frames
+    lws_message_free(state, state->message_data);
+    state->message_data = NULL;
+    state->message_len = 0;
+    state->message_sz = 0;
   }
 }
 
@@ -73,6 +211,9 @@ int libwebsock_handle_control_frame(libwebsock_client_state *state)
 {
   int retval = 0;
   libwebsock_frame *ctl_frame = state->current_frame;
+
+  //messages completed before this frame are reported first
+  libwebsock_flush_batch(state);
   logdebug("calling control callback method");
   retval = state->oncontrol(state, ctl_frame);
   
@@ -86,17 +227,13 @@ int libwebsock_handle_control_frame(libwebsock_client_state *state)
 
 void libwebsock_cleanup_frames(libwebsock_client_state *state, libwebsock_frame *first)
 {
-  logdebug("freeing frames from given entry");
+  logdebug("releasing frames from given entry");
   libwebsock_frame *this = NULL;
   libwebsock_frame *next = first;
   while (next != NULL)
   {
     this = next;
     next = this->next_frame;
-    if (this->rawdata != NULL)
-    {
-      lws_free(this->rawdata);
-    }
-    lws_free(this);
+    libwebsock_release_frame(state, this);
   }
 }
@@ -22,8 +22,11 @@
 #include "types.h"
 
 
+libwebsock_frame *libwebsock_new_frame(libwebsock_client_state *state);
 int libwebsock_new_continuation_frame(libwebsock_client_state *state);
+int libwebsock_append_fragment(libwebsock_client_state *state, libwebsock_frame *frame);
 int libwebsock_fail_and_cleanup(libwebsock_client_state *state);
+int libwebsock_fail_no_memory(libwebsock_client_state *state);
 void libwebsock_free_all_frames(libwebsock_client_state *state);
 void libwebsock_cleanup_frames(libwebsock_client_state *state, libwebsock_frame *first);
 void libwebsock_dump_frame(libwebsock_client_state *state, libwebsock_frame *frame);
@@ -0,0 +1,161 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "mask.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LWS_HAVE_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+typedef void (*lws_unmask_fn)(char *dst, const char *src, size_t len, uint32_t mask32);
+
+/*
+ * All kernels take the mask already rotated to the first byte and packed in
+ * memory order into mask32, so any block size that is a multiple of 4 can
+ * simply repeat it.  Each block is loaded before it is stored, which keeps
+ * dst <= src overlap safe.
+ */
+static void lws_unmask_tail(char *dst, const char *src, size_t len, uint32_t mask32)
+{
+  const unsigned char *mask = (const unsigned char *)&mask32;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    dst[i] = src[i] ^ mask[i & 3];
+  }
+}
+
+static void lws_unmask_scalar(char *dst, const char *src, size_t len, uint32_t mask32)
+{
+  uint64_t mask64 = ((uint64_t)mask32 << 32) | mask32;
+  uint64_t block;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8)
+  {
+    memcpy(&block, src + i, 8);
+    block ^= mask64;
+    memcpy(dst + i, &block, 8);
+  }
+  lws_unmask_tail(dst + i, src + i, len - i, mask32);
+}
+
+#ifdef LWS_HAVE_X86_DISPATCH
+__attribute__((target("sse2"))) static void lws_unmask_sse2(char *dst, const char *src, size_t len, uint32_t mask32)
+{
+  __m128i mask128 = _mm_set1_epi32((int)mask32);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(block, mask128));
+  }
+  lws_unmask_scalar(dst + i, src + i, len - i, mask32);
+}
+
+__attribute__((target("avx2"))) static void lws_unmask_avx2(char *dst, const char *src, size_t len, uint32_t mask32)
+{
+  __m256i mask256 = _mm256_set1_epi32((int)mask32);
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(block, mask256));
+  }
+  lws_unmask_scalar(dst + i, src + i, len - i, mask32);
+}
+
+__attribute__((target("avx512f"))) static void lws_unmask_avx512(char *dst, const char *src, size_t len, uint32_t mask32)
+{
+  __m512i mask512 = _mm512_set1_epi32((int)mask32);
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64)
+  {
+    __m512i block = _mm512_loadu_si512((const void *)(src + i));
+    _mm512_storeu_si512((void *)(dst + i), _mm512_xor_si512(block, mask512));
+  }
+  lws_unmask_avx2(dst + i, src + i, len - i, mask32);
+}
+#endif
+
+static void lws_unmask_resolve(char *dst, const char *src, size_t len, uint32_t mask32);
+
+static lws_unmask_fn lws_unmask_impl = lws_unmask_resolve;
+
+/*
+ * Picks the widest kernel the running CPU supports on first use.  Threads
+ * may race to resolve it; they all store the same pointer, and the atomic
+ * accesses keep that well defined.
+ */
+static void lws_unmask_resolve(char *dst, const char *src, size_t len, uint32_t mask32)
+{
+  lws_unmask_fn impl = lws_unmask_scalar;
+
+#ifdef LWS_HAVE_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+  {
+    impl = lws_unmask_avx512;
+  }
+  else if (__builtin_cpu_supports("avx2"))
+  {
+    impl = lws_unmask_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    impl = lws_unmask_sse2;
+  }
+#endif
+
+  __atomic_store_n(&lws_unmask_impl, impl, __ATOMIC_RELAXED);
+  impl(dst, src, len, mask32);
+}
+
+uint32_t lws_mask32(const unsigned char *mask, size_t offset)
+{
+  unsigned char rotated[4];
+  uint32_t mask32;
+  int i;
+
+  for (i = 0; i < 4; i++)
+  {
+    rotated[i] = mask[(offset + i) & 3];
+  }
+  memcpy(&mask32, rotated, sizeof(mask32));
+  return mask32;
+}
+
+void lws_unmask(char *dst, const char *src, size_t len, const unsigned char *mask, size_t offset)
+{
+  uint32_t mask32 = lws_mask32(mask, offset);
+
+  if (len < 16)
+  {
+    lws_unmask_tail(dst, src, len, mask32);
+    return;
+  }
+  __atomic_load_n(&lws_unmask_impl, __ATOMIC_RELAXED)(dst, src, len, mask32);
+}
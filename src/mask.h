@@ -0,0 +1,35 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef MASK_H_
+#define MASK_H_
+#include <stddef.h>
+#include <stdint.h>
+
+//the mask rotated to start at payload position offset, packed in memory order
+uint32_t lws_mask32(const unsigned char *mask, size_t offset);
+
+/*
+ * XORs len bytes of src with the 4-byte frame mask into dst.  offset is the
+ * position of src[0] within the payload, so a payload can be unmasked in
+ * pieces.  dst may equal src or lie before it.  Uses the widest of
+ * AVX-512/AVX2/SSE2 available at runtime, falling back to 8 bytes per step.
+ */
+void lws_unmask(char *dst, const char *src, size_t len, const unsigned char *mask, size_t offset);
+#endif /* MASK_H_ */
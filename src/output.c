@@ -0,0 +1,817 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "websock.h"
+#include "logger.h"
+
+/*
+ * Outgoing bytes are kept in a chain of segments.  Copied frames are packed
+ * back to back into OUTPUT_SEGMENT_SIZE buffers, so queueing never moves
+ * what is already there; frames sent by reference get a segment of their
+ * own.  out_pending counts bytes not yet consumed and drives the watermark
+ * callbacks.
+ */
+
+unsigned int lws_encode_header(char *out, int flags, size_t len)
+{
+  uint16_t len16_be;
+  uint64_t len64_be;
+
+  out[0] = flags & 0xff;
+  if (len <= 125)
+  {
+    out[1] = len & 0x7f;
+    return 2;
+  }
+  else if (len <= 0xffff)
+  {
+    out[1] = 126;
+    len16_be = htons(len & 0xffff);
+    memcpy(out + 2, &len16_be, sizeof(len16_be));
+    return 4;
+  }
+  else if (len <= SSIZE_MAX - 10)
+  {
+    out[1] = 127;
+    len64_be = htobe64((uint64_t)len);
+    memcpy(out + 2, &len64_be, sizeof(len64_be));
+    return 10;
+  }
+  return 0;
+}
+
+static void lws_output_link(libwebsock_client_state *state, libwebsock_out_segment *seg)
+{
+  if (state->out_tail != NULL)
+  {
+    state->out_tail->next = seg;
+  }
+  else
+  {
+    state->out_head = seg;
+  }
+  state->out_tail = seg;
+}
+
+static void lws_output_free_segment(libwebsock_client_state *state, libwebsock_out_segment *seg)
+{
+  if (seg->release != NULL)
+  {
+    seg->release(seg->release_arg);
+  }
+  lws_state_free(state, seg->owned);
+  lws_state_free(state, seg);
+}
+
+static void lws_output_added(libwebsock_client_state *state, size_t len)
+{
+  state->out_pending += len;
+  if (state->out_high_watermark > 0 && state->out_pending >= state->out_high_watermark &&
+      (state->flags & STATE_OUTPUT_CONGESTED) == 0)
+  {
+    state->flags |= STATE_OUTPUT_CONGESTED;
+    logdebug("output high watermark reached with %zu bytes pending", state->out_pending);
+    if (state->onhighwater)
+    {
+      state->onhighwater(state);
+    }
+  }
+}
+
+static void lws_output_removed(libwebsock_client_state *state, size_t len)
+{
+  state->out_pending -= len;
+  if ((state->flags & STATE_OUTPUT_CONGESTED) && state->out_pending <= state->out_low_watermark)
+  {
+    state->flags &= ~STATE_OUTPUT_CONGESTED;
+    logdebug("output drained to low watermark with %zu bytes pending", state->out_pending);
+    if (state->onlowwater)
+    {
+      state->onlowwater(state);
+    }
+  }
+}
+
+static libwebsock_out_segment *lws_output_alloc_buffer(libwebsock_client_state *state, size_t len)
+{
+  libwebsock_out_segment *seg;
+  size_t capacity = len > OUTPUT_SEGMENT_SIZE ? len : OUTPUT_SEGMENT_SIZE;
+
+  if (capacity > SIZE_MAX - sizeof(libwebsock_out_segment))
+  {
+    return NULL;
+  }
+  seg = (libwebsock_out_segment *)lws_state_malloc(state, sizeof(libwebsock_out_segment) + capacity);
+  if (seg == NULL)
+  {
+    logerror("unable to grow output queue");
+    return NULL;
+  }
+  memset(seg, 0, sizeof(libwebsock_out_segment));
+  seg->payload = (const char *)(seg + 1);
+  seg->capacity = capacity;
+  return seg;
+}
+
+static libwebsock_out_segment *lws_output_new_buffer(libwebsock_client_state *state, size_t len)
+{
+  libwebsock_out_segment *seg = lws_output_alloc_buffer(state, len);
+
+  if (seg != NULL)
+  {
+    lws_output_link(state, seg);
+  }
+  return seg;
+}
+
+//the segment a reservation lives in, its payload starting right behind it
+static libwebsock_out_segment *lws_output_reserved_segment(libwebsock_client_state *state)
+{
+  return (libwebsock_out_segment *)state->out_reserved - 1;
+}
+
+/*
+ * Returns room for len more bytes at the end of the queue, packed into the
+ * last buffer segment when it fits.  The bytes count as pending right away.
+ */
+char *lws_output_reserve(libwebsock_client_state *state, size_t len)
+{
+  libwebsock_out_segment *seg = state->out_tail;
+  char *out;
+
+  if (seg == NULL || seg->capacity == 0 || seg->capacity - seg->payload_len < len)
+  {
+    seg = lws_output_new_buffer(state, len);
+    if (seg == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  out = (char *)(seg + 1) + seg->payload_len;
+  seg->payload_len += len;
+  lws_output_added(state, len);
+  return out;
+}
+
+static ssize_t lws_output_write_copy(libwebsock_client_state *state, const char *data, size_t len, int flags)
+{
+  char header[14];
+  unsigned int header_len = lws_encode_header(header, flags, len);
+  uint32_t key;
+  char *out;
+
+  if (header_len == 0)
+  {
+    logerror("frame payload of %zu bytes does not fit in memory", len);
+    return -1;
+  }
+
+  //a client masks with a fresh key, copying and masking in the same pass
+  if (state->flags & STATE_CLIENT)
+  {
+    key = lws_prng_next(&state->mask_prng);
+    header[1] |= 0x80;
+    memcpy(header + header_len, &key, MASK_LENGTH);
+    header_len += MASK_LENGTH;
+  }
+
+  out = lws_output_reserve(state, header_len + len);
+  if (out == NULL)
+  {
+    return -1;
+  }
+  memcpy(out, header, header_len);
+  if (state->flags & STATE_CLIENT)
+  {
+    lws_unmask(out + header_len, data, len, (const unsigned char *)&key, 0);
+  }
+  else
+  {
+    memcpy(out + header_len, data, len);
+  }
+  return header_len + len;
+}
+
+static libwebsock_out_segment *lws_output_link_ref(libwebsock_client_state *state, const char *data, size_t len,
+                                                   libwebsock_release_fn release, void *release_arg)
+{
+  libwebsock_out_segment *seg = (libwebsock_out_segment *)lws_state_calloc(state, sizeof(libwebsock_out_segment));
+
+  if (seg == NULL)
+  {
+    logerror("unable to queue frame");
+    return NULL;
+  }
+  seg->payload = data;
+  seg->payload_len = len;
+  seg->release = release;
+  seg->release_arg = release_arg;
+  lws_output_link(state, seg);
+  return seg;
+}
+
+static ssize_t lws_output_write_ref(libwebsock_client_state *state, const char *data, size_t len, int flags,
+                                    libwebsock_release_fn release, void *release_arg)
+{
+  libwebsock_out_segment *seg;
+  char header[sizeof(seg->header)];
+  unsigned int header_len = lws_encode_header(header, flags, len);
+
+  if (header_len == 0)
+  {
+    logerror("frame payload of %zu bytes does not fit in memory", len);
+    return -1;
+  }
+
+  seg = lws_output_link_ref(state, data, len, release, release_arg);
+  if (seg == NULL)
+  {
+    return -1;
+  }
+  memcpy(seg->header, header, header_len);
+  seg->header_len = header_len;
+  lws_output_added(state, header_len + len);
+  return header_len + len;
+}
+
+static ssize_t lws_output_write_encoded(libwebsock_client_state *state, const char *data, size_t len,
+                                        libwebsock_release_fn release, void *release_arg)
+{
+  if (lws_output_link_ref(state, data, len, release, release_arg) == NULL)
+  {
+    return -1;
+  }
+  lws_output_added(state, len);
+  return len;
+}
+
+/*
+ * Data frames are held back in one of two lanes, high and bulk, whenever
+ * they can't go straight out: they need splitting, something is already
+ * held back, another lane's message is half sent, or a fragment's worth is
+ * already waiting to be written.  Control frames never wait, which makes
+ * the output queue itself the control lane.  out_lane_busy is 1 + the lane
+ * whose message has been started but not finished, as no other data frame
+ * may come between its fragments.
+ */
+static int lws_output_lanes_empty(libwebsock_client_state *state)
+{
+  int lane;
+
+  for (lane = 0; lane < WS_PRIORITY_LANES; lane++)
+  {
+    if (state->out_lane_head[lane] != NULL)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * The largest data frame to write: max_outbound_frame_size if set, else
+ * OUTPUT_LANE_FRAGMENT_SIZE while the bulk lane is in use, so bulk data is
+ * still split and high priority messages can go between its fragments.
+ */
+static size_t lws_output_fragment_size(libwebsock_client_state *state)
+{
+  if (state->max_outbound_frame_size > 0)
+  {
+    return state->max_outbound_frame_size;
+  }
+  if (state->send_priority == WS_PRIORITY_BULK || !lws_output_lanes_empty(state) || state->out_lane_busy != 0)
+  {
+    return OUTPUT_LANE_FRAGMENT_SIZE;
+  }
+  return 0;
+}
+
+static int lws_output_should_defer(libwebsock_client_state *state, int flags, size_t len)
+{
+  size_t max = lws_output_fragment_size(state);
+
+  if (flags & 0x08)
+  {
+    return 0;
+  }
+  if (!lws_output_lanes_empty(state) ||
+      (state->out_lane_busy != 0 && state->out_lane_busy != state->send_priority + 1))
+  {
+    return 1;
+  }
+  return max > 0 && (len > max || state->out_pending - state->out_deferred >= max);
+}
+
+//tracks which lane, if any, is in the middle of a message
+static void lws_output_sent_data(libwebsock_client_state *state, int lane, int flags)
+{
+  if ((flags & WS_FRAGMENT_FIN) == 0)
+  {
+    state->out_lane_busy = lane + 1;
+    return;
+  }
+
+  state->out_lane_busy = 0;
+  if (lane == WS_PRIORITY_HIGH && state->out_lane_head[WS_PRIORITY_BULK] != NULL)
+  {
+    state->out_high_streak++;
+  }
+  else
+  {
+    state->out_high_streak = 0;
+  }
+}
+
+static ssize_t lws_output_defer(libwebsock_client_state *state, const char *data, size_t len, int flags,
+                                int copy, int encoded, libwebsock_release_fn release, void *release_arg)
+{
+  libwebsock_out_message *msg;
+  int lane = state->send_priority;
+
+  if (copy && len > SIZE_MAX - sizeof(libwebsock_out_message))
+  {
+    return -1;
+  }
+  msg = (libwebsock_out_message *)lws_state_malloc(state, sizeof(libwebsock_out_message) + (copy ? len : 0));
+  if (msg == NULL)
+  {
+    logerror("unable to queue frame");
+    return -1;
+  }
+  memset(msg, 0, sizeof(libwebsock_out_message));
+  if (copy)
+  {
+    memcpy(msg + 1, data, len);
+    data = (const char *)(msg + 1);
+  }
+  msg->payload = data;
+  msg->len = len;
+  msg->flags = flags;
+  msg->encoded = encoded;
+  msg->release = release;
+  msg->release_arg = release_arg;
+
+  if (state->out_lane_tail[lane] != NULL)
+  {
+    state->out_lane_tail[lane]->next = msg;
+  }
+  else
+  {
+    state->out_lane_head[lane] = msg;
+  }
+  state->out_lane_tail[lane] = msg;
+  state->out_deferred += len;
+  lws_output_added(state, len);
+  return len;
+}
+
+/*
+ * The lane to take the next fragment from: the one with a message under
+ * way, else high, except that bulk gets a turn after OUTPUT_HIGH_BURST high
+ * messages went ahead of it.  -1 if nothing can be sent yet.
+ */
+static int lws_output_next_lane(libwebsock_client_state *state)
+{
+  if (state->out_lane_busy != 0)
+  {
+    return state->out_lane_head[state->out_lane_busy - 1] != NULL ? state->out_lane_busy - 1 : -1;
+  }
+  if (state->out_lane_head[WS_PRIORITY_BULK] != NULL &&
+      (state->out_lane_head[WS_PRIORITY_HIGH] == NULL || state->out_high_streak >= OUTPUT_HIGH_BURST))
+  {
+    return WS_PRIORITY_BULK;
+  }
+  return state->out_lane_head[WS_PRIORITY_HIGH] != NULL ? WS_PRIORITY_HIGH : -1;
+}
+
+/*
+ * Moves held back frames into the queue one fragment at a time, for as long
+ * as less than a fragment's worth is waiting to be written.  The first
+ * fragment keeps the message's opcode and RSV bits, the rest are
+ * continuations, and only the last carries FIN if the message had it.
+ */
+static void lws_output_refill(libwebsock_client_state *state)
+{
+  libwebsock_out_message *msg;
+  size_t max = state->max_outbound_frame_size > 0 ? state->max_outbound_frame_size : OUTPUT_LANE_FRAGMENT_SIZE;
+  size_t remaining, frag;
+  int flags, by_ref, lane;
+  ssize_t ret;
+
+  while ((lane = lws_output_next_lane(state)) != -1)
+  {
+    if (state->out_pending - state->out_deferred >= max)
+    {
+      break;
+    }
+
+    msg = state->out_lane_head[lane];
+    remaining = msg->len - msg->offset;
+    frag = msg->encoded || remaining <= max ? remaining : max;
+    flags = msg->offset == 0 ? msg->flags & ~WS_FRAGMENT_FIN : WS_OPCODE_CONTINUE;
+    if (frag == remaining)
+    {
+      flags |= msg->flags & WS_FRAGMENT_FIN;
+    }
+
+    //the bytes were counted when deferred, the write counts them again
+    state->out_pending -= frag;
+    state->out_deferred -= frag;
+    by_ref = msg->encoded || (state->flags & STATE_CLIENT) == 0;
+    if (msg->encoded)
+    {
+      ret = lws_output_write_encoded(state, msg->payload, frag, NULL, NULL);
+    }
+    else if (by_ref)
+    {
+      ret = lws_output_write_ref(state, msg->payload + msg->offset, frag, flags, NULL, NULL);
+    }
+    else
+    {
+      ret = lws_output_write_copy(state, msg->payload + msg->offset, frag, flags);
+    }
+    if (ret == -1)
+    {
+      state->out_pending += frag;
+      state->out_deferred += frag;
+      break;
+    }
+
+    msg->offset += frag;
+    if (msg->offset < msg->len)
+    {
+      state->out_lane_busy = lane + 1;
+      continue;
+    }
+
+    state->out_lane_head[lane] = msg->next;
+    if (state->out_lane_head[lane] == NULL)
+    {
+      state->out_lane_tail[lane] = NULL;
+    }
+    lws_output_sent_data(state, lane, flags);
+    if (by_ref)
+    {
+      //the last fragment keeps the payload alive until it is written
+      state->out_tail->release = msg->release;
+      state->out_tail->release_arg = msg->release_arg;
+      state->out_tail->owned = msg;
+    }
+    else
+    {
+      if (msg->release != NULL)
+      {
+        msg->release(msg->release_arg);
+      }
+      lws_state_free(state, msg);
+    }
+  }
+}
+
+ssize_t lws_output_queue_copy(libwebsock_client_state *state, const char *data, size_t len, int flags)
+{
+  ssize_t retval;
+
+  if (lws_output_should_defer(state, flags, len))
+  {
+    return lws_output_defer(state, data, len, flags, 1, 0, NULL, NULL);
+  }
+  retval = lws_output_write_copy(state, data, len, flags);
+  if (retval != -1 && (flags & 0x08) == 0)
+  {
+    lws_output_sent_data(state, state->send_priority, flags);
+  }
+  return retval;
+}
+
+ssize_t lws_output_queue_ref(libwebsock_client_state *state, const char *data, size_t len, int flags,
+                             libwebsock_release_fn release, void *release_arg)
+{
+  ssize_t retval;
+
+  if (lws_output_should_defer(state, flags, len))
+  {
+    return lws_output_defer(state, data, len, flags, 0, 0, release, release_arg);
+  }
+  retval = lws_output_write_ref(state, data, len, flags, release, release_arg);
+  if (retval != -1 && (flags & 0x08) == 0)
+  {
+    lws_output_sent_data(state, state->send_priority, flags);
+  }
+  return retval;
+}
+
+//queues bytes that already form a complete frame, header included; never split
+ssize_t lws_output_queue_encoded(libwebsock_client_state *state, const char *data, size_t len,
+                                 libwebsock_release_fn release, void *release_arg)
+{
+  int flags = data[0] & 0xff;
+  ssize_t retval;
+
+  if (lws_output_should_defer(state, flags, 0))
+  {
+    return lws_output_defer(state, data, len, flags, 0, 1, release, release_arg);
+  }
+  retval = lws_output_write_encoded(state, data, len, release, release_arg);
+  if (retval != -1 && (flags & 0x08) == 0)
+  {
+    lws_output_sent_data(state, state->send_priority, flags);
+  }
+  return retval;
+}
+
+/*
+ * Sets aside max_len bytes for a frame's payload to be written in place, in
+ * a buffer segment of its own that joins the queue only when committed.
+ * Frames queued in the meantime, such as the pong answering a ping, go
+ * ahead of it and can't land in the reserved space.
+ */
+char *lws_output_reserve_frame(libwebsock_client_state *state, size_t max_len)
+{
+  libwebsock_out_segment *seg;
+  char header[14];
+
+  if (lws_encode_header(header, 0, max_len) == 0)
+  {
+    logerror("frame payload of %zu bytes does not fit in memory", max_len);
+    return NULL;
+  }
+
+  seg = lws_output_alloc_buffer(state, max_len);
+  if (seg == NULL)
+  {
+    return NULL;
+  }
+  state->out_reserved = (char *)(seg + 1);
+  state->out_reserved_len = max_len;
+  return state->out_reserved;
+}
+
+//gives back a reservation that won't be committed
+void lws_output_cancel_reserved(libwebsock_client_state *state)
+{
+  if (state->out_reserved != NULL)
+  {
+    lws_state_free(state, lws_output_reserved_segment(state));
+  }
+  state->out_reserved = NULL;
+  state->out_reserved_len = 0;
+}
+
+/*
+ * Turns the first len bytes of the reserved space into a frame by writing
+ * its header into the segment and putting the segment at the end of the
+ * queue, masking the payload in place for a client.  A frame that has to
+ * wait in a lane is copied there instead.
+ */
+ssize_t lws_output_commit_frame(libwebsock_client_state *state, size_t len, int flags)
+{
+  libwebsock_out_segment *seg;
+  char *payload = state->out_reserved;
+  unsigned int header_len;
+  uint32_t key;
+  ssize_t retval;
+
+  if (payload == NULL || len > state->out_reserved_len)
+  {
+    logerror("commit of %zu bytes does not match a reservation", len);
+    return -1;
+  }
+  seg = lws_output_reserved_segment(state);
+  state->out_reserved = NULL;
+  state->out_reserved_len = 0;
+
+  if (lws_output_should_defer(state, flags, len))
+  {
+    retval = lws_output_defer(state, payload, len, flags, 1, 0, NULL, NULL);
+    lws_state_free(state, seg);
+    return retval;
+  }
+
+  header_len = lws_encode_header(seg->header, flags, len);
+  if (state->flags & STATE_CLIENT)
+  {
+    key = lws_prng_next(&state->mask_prng);
+    seg->header[1] |= 0x80;
+    memcpy(seg->header + header_len, &key, MASK_LENGTH);
+    header_len += MASK_LENGTH;
+    lws_unmask(payload, payload, len, (const unsigned char *)&key, 0);
+  }
+  seg->header_len = header_len;
+  seg->payload_len = len;
+  lws_output_link(state, seg);
+  lws_output_added(state, header_len + len);
+  if ((flags & 0x08) == 0)
+  {
+    lws_output_sent_data(state, state->send_priority, flags);
+  }
+  return header_len + len;
+}
+
+//drops everything still queued, payloads held by reference are released
+void lws_output_release_all(libwebsock_client_state *state)
+{
+  libwebsock_out_segment *seg, *next;
+  libwebsock_out_message *msg, *next_msg;
+  int lane;
+
+  for (seg = state->out_head; seg != NULL; seg = next)
+  {
+    next = seg->next;
+    lws_output_free_segment(state, seg);
+  }
+  state->out_head = NULL;
+  state->out_tail = NULL;
+
+  for (lane = 0; lane < WS_PRIORITY_LANES; lane++)
+  {
+    for (msg = state->out_lane_head[lane]; msg != NULL; msg = next_msg)
+    {
+      next_msg = msg->next;
+      if (msg->release != NULL)
+      {
+        msg->release(msg->release_arg);
+      }
+      lws_state_free(state, msg);
+    }
+    state->out_lane_head[lane] = NULL;
+    state->out_lane_tail[lane] = NULL;
+  }
+  state->out_lane_busy = 0;
+  state->out_high_streak = 0;
+  lws_output_cancel_reserved(state);
+  state->out_deferred = 0;
+  state->out_pending = 0;
+  state->flags &= ~STATE_OUTPUT_CONGESTED;
+}
+
+/*
+ * Like libwebsock_output_iov, but nothing is handed out while the
+ * connection is corked, and the number of bytes the entries cover is stored
+ * in nbytes when it isn't NULL.  A writev() of that many bytes leaves
+ * nothing behind in the entries given.
+ */
+int libwebsock_pending_iov(libwebsock_client_state *state, struct iovec *iov, int iovcnt, size_t *nbytes)
+{
+  libwebsock_out_segment *seg;
+  size_t skip, total = 0;
+  int n = 0;
+
+  if ((state->flags & STATE_OUTPUT_CORKED) == 0)
+  {
+    lws_output_refill(state);
+    seg = state->out_head;
+  }
+  else
+  {
+    seg = NULL;
+  }
+  for (; seg != NULL && n < iovcnt; seg = seg->next)
+  {
+    skip = seg->sent;
+    if (skip < seg->header_len)
+    {
+      iov[n].iov_base = seg->header + skip;
+      iov[n].iov_len = seg->header_len - skip;
+      total += iov[n].iov_len;
+      n++;
+      skip = 0;
+    }
+    else
+    {
+      skip -= seg->header_len;
+    }
+
+    if (skip < seg->payload_len && n < iovcnt)
+    {
+      iov[n].iov_base = (void *)(seg->payload + skip);
+      iov[n].iov_len = seg->payload_len - skip;
+      total += iov[n].iov_len;
+      n++;
+    }
+  }
+
+  if (nbytes != NULL)
+  {
+    *nbytes = total;
+  }
+  return n;
+}
+
+int libwebsock_output_iov(libwebsock_client_state *state, struct iovec *iov, int iovcnt)
+{
+  return libwebsock_pending_iov(state, iov, iovcnt, NULL);
+}
+
+/*
+ * While corked, frames keep being queued but none are handed out for
+ * writing, so whatever a handler sends in response to one event goes out
+ * together in a single writev() once uncorked.  Uncorking returns the
+ * number of bytes libwebsock_pending_iov can hand out right away; data
+ * still held back in the send lanes, which libwebsock_output_pending does
+ * count, joins them as the queue drains.
+ */
+void libwebsock_cork(libwebsock_client_state *state)
+{
+  state->flags |= STATE_OUTPUT_CORKED;
+}
+
+size_t libwebsock_uncork(libwebsock_client_state *state)
+{
+  state->flags &= ~STATE_OUTPUT_CORKED;
+  lws_output_refill(state);
+  return state->out_pending - state->out_deferred;
+}
+
+void libwebsock_output_consume(libwebsock_client_state *state, size_t nbytes)
+{
+  libwebsock_out_segment *seg;
+  size_t left;
+
+  if (nbytes > state->out_pending)
+  {
+    logerror("consumed %zu bytes but only %zu are pending", nbytes, state->out_pending);
+    nbytes = state->out_pending;
+  }
+  lws_output_removed(state, nbytes);
+
+  while ((seg = state->out_head) != NULL && nbytes > 0)
+  {
+    left = seg->header_len + seg->payload_len - seg->sent;
+    if (nbytes < left)
+    {
+      seg->sent += nbytes;
+      return;
+    }
+    nbytes -= left;
+    if (seg == state->out_tail && seg->capacity == OUTPUT_SEGMENT_SIZE)
+    {
+      //queue is empty, keep the buffer for the next frames
+      seg->payload_len = 0;
+      seg->header_len = 0;
+      seg->sent = 0;
+      return;
+    }
+    state->out_head = seg->next;
+    if (state->out_head == NULL)
+    {
+      state->out_tail = NULL;
+    }
+    lws_output_free_segment(state, seg);
+  }
+}
+
+size_t libwebsock_output_pending(libwebsock_client_state *state)
+{
+  return state->out_pending;
+}
+
+/*
+ * onhighwater fires once pending output reaches high, onlowwater once it
+ * has drained back down to low; STATE_OUTPUT_CONGESTED is set in between.
+ * A high of 0 turns the callbacks off.
+ */
+void libwebsock_set_output_watermarks(libwebsock_client_state *state, size_t low, size_t high)
+{
+  state->out_low_watermark = low;
+  state->out_high_watermark = high;
+}
+
+/*
+ * Picks the lane for data frames made from now on.  WS_PRIORITY_HIGH, the
+ * default, is served before WS_PRIORITY_BULK.  Lanes only reorder frames
+ * that are held back, which bulk data past a fragment's worth always is:
+ * it goes out in max_outbound_frame_size fragments, or
+ * OUTPUT_LANE_FRAGMENT_SIZE ones if that is 0, so a high priority message
+ * waits for the bulk message under way but not for those queued behind
+ * it.  A message already started always finishes first.
+ */
+int libwebsock_set_send_priority(libwebsock_client_state *state, int priority)
+{
+  if (priority < 0 || priority >= WS_PRIORITY_LANES)
+  {
+    return -1;
+  }
+  state->send_priority = priority;
+  return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "types.h"
+
+//writes the header for a frame of len bytes, returns its length or 0 if len is too big
+unsigned int lws_encode_header(char *out, int flags, size_t len);
+char *lws_output_reserve(libwebsock_client_state *state, size_t len);
+ssize_t lws_output_queue_copy(libwebsock_client_state *state, const char *data, size_t len, int flags);
+ssize_t lws_output_queue_ref(libwebsock_client_state *state, const char *data, size_t len, int flags,
+                             libwebsock_release_fn release, void *release_arg);
+ssize_t lws_output_queue_encoded(libwebsock_client_state *state, const char *data, size_t len,
+                                 libwebsock_release_fn release, void *release_arg);
+char *lws_output_reserve_frame(libwebsock_client_state *state, size_t max_len);
+void lws_output_cancel_reserved(libwebsock_client_state *state);
+ssize_t lws_output_commit_frame(libwebsock_client_state *state, size_t len, int flags);
+void lws_output_release_all(libwebsock_client_state *state);
+
+/*
+ * Fills iov with the pending output, oldest first, ready for writev() or
+ * sendmsg().  Returns the number of entries used.  Nothing is dequeued until
+ * libwebsock_output_consume is told how many bytes were written.  Nothing
+ * is handed out while the connection is corked.
+ */
+int libwebsock_output_iov(libwebsock_client_state *state, struct iovec *iov, int iovcnt);
+int libwebsock_pending_iov(libwebsock_client_state *state, struct iovec *iov, int iovcnt, size_t *nbytes);
+void libwebsock_cork(libwebsock_client_state *state);
+size_t libwebsock_uncork(libwebsock_client_state *state);
+void libwebsock_output_consume(libwebsock_client_state *state, size_t nbytes);
+size_t libwebsock_output_pending(libwebsock_client_state *state);
+void libwebsock_set_output_watermarks(libwebsock_client_state *state, size_t low, size_t high);
+int libwebsock_set_send_priority(libwebsock_client_state *state, int priority);
+#endif /* OUTPUT_H_ */
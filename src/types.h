@@ -20,30 +20,40 @@
 #ifndef TYPES_H_
 #define TYPES_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MAX_SUB_PROTOCOLS 8
 #define MAX_SUB_PROTOCOL_LEN 128
 #define MAX_PATH 4096
 
+#define WS_PRIORITY_HIGH 0
+#define WS_PRIORITY_BULK 1
+#define WS_PRIORITY_LANES 2
+
 enum WS_FRAME_STATE
 {
         sw_start = 0,
         sw_got_two,
         sw_got_short_len,
         sw_got_full_len,
-        sw_loaded_mask
+        sw_loaded_mask,
+        sw_streaming
 };
 
 typedef struct _libwebsock_frame
 {
         unsigned int fin;
+        unsigned int rsv;
         unsigned int opcode;
+        unsigned int masked;
         unsigned int mask_offset;
         unsigned int payload_offset;
-        unsigned int rawdata_idx;
-        unsigned int rawdata_sz;
-        unsigned int size;
+        uint64_t rawdata_idx;
+        size_t rawdata_sz;
+        uint64_t size;
         unsigned int payload_len_short;
-        unsigned int payload_len;
+        uint64_t payload_len;
         char *rawdata;
         struct _libwebsock_frame *next_frame;
         struct _libwebsock_frame *prev_frame;
@@ -51,14 +61,6 @@ typedef struct _libwebsock_frame
         enum WS_FRAME_STATE state;
 } libwebsock_frame;
 
-typedef struct _libwebsock_string
-{
-        char *data;
-        int length;
-        int idx;
-        int data_sz;
-} libwebsock_string;
-
 typedef struct _libwebsock_message
 {
         unsigned int opcode;
@@ -85,23 +87,220 @@ typedef struct _libwebsock_logger
         char filename[MAX_PATH];
 } libwebsock_logger;
 
+/*
+ * A malloc/realloc/free vtable with a context pointer.  A state has one for
+ * everything it allocates and, optionally, another for message payloads
+ * whose memory can be released in bulk once each message is delivered; see
+ * libwebsock_set_message_allocator.
+ */
+typedef struct _libwebsock_allocator
+{
+        void *(*malloc_fn)(void *ctx, size_t size);
+        void *(*realloc_fn)(void *ctx, void *ptr, size_t size);
+        void (*free_fn)(void *ctx, void *ptr);
+        void *ctx;
+} libwebsock_allocator;
+
+typedef void (*libwebsock_release_fn)(void *arg);
+
+/*
+ * permessage-deflate settings.  The server_ and client_ parameters are
+ * named as in RFC 7692, after the side that compresses: a server limits
+ * its own window with server_max_window_bits, a client asks the server to.
+ * memory_limit caps what zlib may allocate for the connection, 0 for no
+ * cap; window sizes and mem_level are lowered at negotiation to fit under
+ * it, and deflate is not negotiated, with an error logged, when even the
+ * smallest settings don't fit: about 20K, or 50K when the peer's window
+ * can't be limited.  Messages shorter than min_length are sent
+ * uncompressed.  With a pool the connection borrows its streams from it
+ * instead of keeping its own.
+ */
+typedef struct _libwebsock_deflate_options
+{
+        int level;
+        int mem_level;
+        int server_max_window_bits;
+        int client_max_window_bits;
+        int server_no_context_takeover;
+        int client_no_context_takeover;
+        size_t memory_limit;
+        size_t min_length;
+        struct _libwebsock_deflate_pool *pool;
+} libwebsock_deflate_options;
+
+/*
+ * Settings for a pool of zlib streams shared by the connections of one
+ * thread.  Pooled connections run without context takeover and borrow a
+ * stream only while they compress or inflate a message, so an idle one
+ * holds no zlib memory.  A borrowed stream counts against the
+ * connection's memory_limit like its own would.  max_idle caps the streams
+ * of each direction kept between messages, 0 for the default.  A
+ * dictionary, if given, primes every message on connections whose peer has
+ * the same one; it wins back some of the ratio lost without context
+ * takeover, most of all on short messages.
+ */
+typedef struct _libwebsock_deflate_pool_options
+{
+        size_t max_idle;
+        const char *dictionary;
+        size_t dictionary_len;
+} libwebsock_deflate_pool_options;
+
+struct _libwebsock_deflate;
+typedef struct _libwebsock_deflate_pool libwebsock_deflate_pool;
+
+struct _libwebsock_client_state;
+
+/*
+ * A WebSocket extension, added to a connection before its handshake with
+ * libwebsock_add_extension.  rsv is the set of RSV bits (0x40, 0x20, 0x10)
+ * it claims; two extensions claiming the same bit are never both in use.
+ * Extensions apply to whole data messages and their bits are only allowed
+ * on a message's first frame.  permessage-deflate, when negotiated too,
+ * claims RSV1 and is always applied last on send and first on receive.
+ *
+ * Negotiation callbacks see and write an element's parameters, the text
+ * after its name such as "; level=3".  accept_offer (server) returns 1 to
+ * take an offer, 0 to decline it; make_offer (client) returns the length
+ * written or -1 to make no offer; accept_response (client) returns -1 if
+ * the server's parameters can't be used.  A NULL callback takes or offers
+ * the extension with no parameters.
+ *
+ * encode gets each whole message sent through the make_* and zerocopy
+ * helpers and returns the RSV bits to set, 0 to send it unchanged or -1 to
+ * fail the send; out must stay valid until the next call.  Frames built
+ * with libwebsock_reserve can't go through it, so no space is reserved
+ * while an extension with encode is in use.  decode gets a
+ * received message that has any of the extension's bits set and returns 0
+ * or a close code.  in may be changed in place and has a spare byte at
+ * in[in_len]; out may point into in or at the extension's own buffer, which
+ * must have a spare byte too and stay valid until the next call.  Nothing
+ * is copied in either direction, except for onmessage_batch, which gets
+ * its own copy of messages decoded into extension buffers.  release is
+ * called when the connection is destroyed.
+ */
+typedef struct _libwebsock_extension
+{
+        const char *name;
+        unsigned int rsv;
+        int (*accept_offer)(struct _libwebsock_client_state *state, void *arg, const char *params, char *response, size_t response_len);
+        int (*make_offer)(struct _libwebsock_client_state *state, void *arg, char *params, size_t params_len);
+        int (*accept_response)(struct _libwebsock_client_state *state, void *arg, const char *params);
+        int (*encode)(struct _libwebsock_client_state *state, void *arg, unsigned int opcode, const char *in, size_t in_len, const char **out, size_t *out_len);
+        unsigned short (*decode)(struct _libwebsock_client_state *state, void *arg, unsigned int opcode, unsigned int rsv, char *in, size_t in_len, char **out, size_t *out_len);
+        void (*release)(struct _libwebsock_client_state *state, void *arg);
+} libwebsock_extension;
+
+struct _libwebsock_extension_slot;
+
+/*
+ * A link in the output queue.  Either a buffer of capacity bytes right
+ * behind this struct that copied frames are packed into, or a single frame
+ * whose header is kept here and whose payload is caller memory, handed back
+ * through release once written.  sent counts bytes already written.
+ */
+typedef struct _libwebsock_out_segment
+{
+        struct _libwebsock_out_segment *next;
+        const char *payload;
+        size_t payload_len;
+        size_t capacity;
+        size_t sent;
+        libwebsock_release_fn release;
+        void *release_arg;
+        void *owned;
+        unsigned int header_len;
+        char header[14];
+} libwebsock_out_segment;
+
+/*
+ * A data frame held back from the output queue because it has to be split
+ * into fragments or is queued behind one that does.  offset counts payload
+ * bytes already turned into fragments.  A copied payload follows the struct.
+ */
+typedef struct _libwebsock_out_message
+{
+        struct _libwebsock_out_message *next;
+        const char *payload;
+        size_t len;
+        size_t offset;
+        int flags;
+        int encoded;
+        libwebsock_release_fn release;
+        void *release_arg;
+} libwebsock_out_message;
+
+/*
+ * A frame encoded once and queued by reference on any number of
+ * connections.  Immutable once made; freed with the allocator it came from
+ * when the last reference is dropped.
+ */
+typedef struct _libwebsock_shared_frame
+{
+        unsigned int refcount;
+        libwebsock_allocator allocator;
+        size_t len;
+        char data[];
+} libwebsock_shared_frame;
+
 typedef struct _libwebsock_client_state
 {
         int flags;
         char hostname[64];
-        libwebsock_string *out_data;
+        libwebsock_out_segment *out_head;
+        libwebsock_out_segment *out_tail;
+        size_t out_pending;
+        libwebsock_out_message *out_lane_head[WS_PRIORITY_LANES];
+        libwebsock_out_message *out_lane_tail[WS_PRIORITY_LANES];
+        size_t out_deferred;
+        int out_lane_busy;
+        unsigned int out_high_streak;
+        int send_priority;
+        char *out_reserved;
+        size_t out_reserved_len;
+        size_t max_outbound_frame_size;
+        size_t out_low_watermark;
+        size_t out_high_watermark;
+        int (*onhighwater)(struct _libwebsock_client_state *);
+        int (*onlowwater)(struct _libwebsock_client_state *);
         libwebsock_frame *current_frame;
+        libwebsock_frame *free_frames;
+        unsigned int free_frames_count;
         int (*onmessage)(struct _libwebsock_client_state *, libwebsock_message *);
         int (*oncontrol)(struct _libwebsock_client_state *, libwebsock_frame *);
         int (*onclose)(struct _libwebsock_client_state *);
         int (*onpong)(struct _libwebsock_client_state *);
         int (*onping)(struct _libwebsock_client_state *);
         int (*onerror)(struct _libwebsock_client_state *, unsigned short code);
+        int (*onmessage_chunk)(struct _libwebsock_client_state *, unsigned int opcode, char *data, size_t len, int is_first, int is_final);
+        int (*onmessage_batch)(struct _libwebsock_client_state *, libwebsock_message *msgs, size_t n);
+        char *message_data;
+        size_t message_len;
+        size_t message_sz;
+        unsigned int message_opcode;
+        unsigned int message_utf8_state;
+        libwebsock_message *batch;
+        char **batch_owned;
+        size_t batch_len;
+        size_t batch_sz;
+        size_t max_frame_size;
+        size_t max_message_size;
         libwebsock_close_info *close_info;
         libwebsock_logger logger;
         char supported_sub_protocols[MAX_SUB_PROTOCOLS][MAX_SUB_PROTOCOL_LEN];
         void (*writelog)(libwebsock_logger logger, enum libwebsock_loglevel level, const char *function, const char *fmt, ...);
         void *context;
+        libwebsock_allocator allocator;
+        libwebsock_allocator message_allocator;
+        void (*message_reset)(void *ctx);
+        uint64_t mask_prng;
+        char accept_key[32];
+        struct _libwebsock_deflate *deflate;
+        struct _libwebsock_extension_slot *extensions;
+        unsigned int extensions_count;
+        unsigned int extensions_active;
+        unsigned int extension_rsv;
+        unsigned int message_rsv;
 
 } libwebsock_client_state;
 
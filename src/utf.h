@@ -20,8 +20,27 @@
 #ifndef UTF_H_
 #define UTF_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define UTF8_ACCEPT 0
+#define UTF8_REJECT 1
+
 uint32_t decode(uint32_t *state, uint32_t *codep, uint32_t byte);
 
+/*
+ * Runs len bytes through the UTF-8 DFA starting from state and returns the new
+ * state: UTF8_ACCEPT at a character boundary, UTF8_REJECT on invalid input,
+ * anything else in the middle of a sequence.  NUL is an ordinary character.
+ * Pure ASCII is skipped 64 bytes at a time and multibyte text is checked 16
+ * bytes per step with SSSE3 when the CPU has it.
+ */
+uint32_t lws_utf8_validate(uint32_t state, const uint8_t *s, size_t len);
+
+/*
+ * Unmasks len bytes of src into dst (see lws_unmask) and validates them in the
+ * same pass, so text payloads are read once.  Returns the new DFA state.
+ */
+uint32_t lws_unmask_utf8(char *dst, const char *src, size_t len, const unsigned char *mask, size_t offset, uint32_t state);
+
 #endif /* UTF_H_ */
@@ -0,0 +1,311 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "utf.h"
+#include "mask.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LWS_HAVE_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+#define ASCII_MASK_64 0x8080808080808080ULL
+#define UNMASK_CHUNK_LENGTH 4096
+
+typedef size_t (*lws_utf8_block_fn)(char *dst, const uint8_t *s, size_t len, uint32_t mask32);
+
+//byte-wise Hoehrmann DFA with an 8-bytes-per-step ASCII skip between sequences
+static uint32_t lws_utf8_validate_scalar(uint32_t state, const uint8_t *s, size_t len)
+{
+  uint32_t codepoint = 0;
+  uint64_t block;
+  size_t i = 0;
+
+  while (i < len)
+  {
+    if (state == UTF8_ACCEPT)
+    {
+      for (; i + 8 <= len; i += 8)
+      {
+        memcpy(&block, s + i, 8);
+        if (block & ASCII_MASK_64)
+        {
+          break;
+        }
+      }
+      if (i == len)
+      {
+        break;
+      }
+    }
+
+    if (decode(&state, &codepoint, s[i++]) == UTF8_REJECT)
+    {
+      break;
+    }
+  }
+
+  return state;
+}
+
+/*
+ * Vector kernels validate whole 64-byte chunks and return how many bytes they
+ * covered, or (size_t)-1 on an invalid sequence.  A multibyte sequence may
+ * run past the covered region; the caller re-checks it with the DFA.  With a
+ * non-NULL dst each chunk is first XORed with mask32 and stored there, so
+ * masked text is unmasked and validated while it is still in registers.
+ */
+static size_t lws_utf8_block_none(char *dst, const uint8_t *s, size_t len, uint32_t mask32)
+{
+  (void)dst;
+  (void)s;
+  (void)len;
+  (void)mask32;
+  return 0;
+}
+
+#ifdef LWS_HAVE_X86_DISPATCH
+/*
+ * Lookup-table validation after Keiser and Lemire, "Validating UTF-8 In Less
+ * Than One Instruction Per Byte".  Each bit flags one class of error for a
+ * (previous byte, current byte) pair; a pair is invalid if a bit survives the
+ * AND of the three nibble lookups.
+ */
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+__attribute__((target("ssse3"))) static inline __m128i lws_utf8_check_block(__m128i input, __m128i prev_input)
+{
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i byte_1_high_tbl = _mm_setr_epi8(
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+      TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+      TOO_SHORT | OVERLONG_2,
+      TOO_SHORT,
+      TOO_SHORT | OVERLONG_3 | SURROGATE,
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+  const __m128i byte_1_low_tbl = _mm_setr_epi8(
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+      CARRY | OVERLONG_2,
+      CARRY,
+      CARRY,
+      CARRY | TOO_LARGE,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000);
+  const __m128i byte_2_high_tbl = _mm_setr_epi8(
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+  __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+  __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+  __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+  __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_tbl, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_tbl, _mm_and_si128(prev1, nibble));
+  __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_tbl, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+  __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+  //third and fourth bytes of a sequence must be continuations, and nothing else may be
+  __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+  __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+  __m128i must23_80 = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_set1_epi8((char)0x80));
+
+  return _mm_xor_si128(must23_80, special_cases);
+}
+
+__attribute__((target("ssse3"))) static size_t lws_utf8_block_ssse3(char *dst, const uint8_t *s, size_t len, uint32_t mask32)
+{
+  const __m128i mask128 = _mm_set1_epi32((int)mask32);
+  //a lead byte in the last 1-3 positions still needs continuation bytes
+  const __m128i max_complete = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                             -1, -1, -1, -1, -1, (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+  __m128i prev_input = _mm_setzero_si128();
+  __m128i prev_incomplete = _mm_setzero_si128();
+  __m128i error = _mm_setzero_si128();
+  __m128i in[4];
+  size_t i = 0;
+  int j;
+
+  for (; i + 64 <= len; i += 64)
+  {
+    for (j = 0; j < 4; j++)
+    {
+      in[j] = _mm_loadu_si128((const __m128i *)(s + i + j * 16));
+    }
+    if (dst != NULL)
+    {
+      for (j = 0; j < 4; j++)
+      {
+        in[j] = _mm_xor_si128(in[j], mask128);
+        _mm_storeu_si128((__m128i *)(dst + i + j * 16), in[j]);
+      }
+    }
+
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(in[0], in[1]), _mm_or_si128(in[2], in[3]))) == 0)
+    {
+      error = _mm_or_si128(error, prev_incomplete);
+      prev_input = _mm_setzero_si128();
+      prev_incomplete = _mm_setzero_si128();
+      continue;
+    }
+
+    for (j = 0; j < 4; j++)
+    {
+      error = _mm_or_si128(error, lws_utf8_check_block(in[j], prev_input));
+      prev_input = in[j];
+    }
+    prev_incomplete = _mm_subs_epu8(prev_input, max_complete);
+  }
+
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xffff)
+  {
+    return (size_t)-1;
+  }
+  return i;
+}
+#endif
+
+static size_t lws_utf8_block_resolve(char *dst, const uint8_t *s, size_t len, uint32_t mask32);
+
+static lws_utf8_block_fn lws_utf8_block_impl = lws_utf8_block_resolve;
+
+//picks the vector kernel on first use; see lws_unmask_resolve about the race
+static size_t lws_utf8_block_resolve(char *dst, const uint8_t *s, size_t len, uint32_t mask32)
+{
+  lws_utf8_block_fn impl = lws_utf8_block_none;
+
+#ifdef LWS_HAVE_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3"))
+  {
+    impl = lws_utf8_block_ssse3;
+  }
+#endif
+
+  __atomic_store_n(&lws_utf8_block_impl, impl, __ATOMIC_RELAXED);
+  return impl(dst, s, len, mask32);
+}
+
+static size_t lws_utf8_block(char *dst, const uint8_t *s, size_t len, uint32_t mask32)
+{
+  return __atomic_load_n(&lws_utf8_block_impl, __ATOMIC_RELAXED)(dst, s, len, mask32);
+}
+
+//start of the last sequence that may be cut off at the end of a vector region
+static size_t lws_utf8_restart(const uint8_t *s, size_t done)
+{
+  size_t k;
+
+  for (k = 1; k <= 3 && k <= done; k++)
+  {
+    if ((s[done - k] & 0xc0) != 0x80)
+    {
+      return s[done - k] >= 0xc0 ? done - k : done;
+    }
+  }
+  return done;
+}
+
+uint32_t lws_utf8_validate(uint32_t state, const uint8_t *s, size_t len)
+{
+  uint32_t codepoint = 0;
+  size_t done, restart;
+
+  //finish a sequence left open by a previous call before going wide
+  while (state != UTF8_ACCEPT && state != UTF8_REJECT && len > 0)
+  {
+    decode(&state, &codepoint, *s++);
+    len--;
+  }
+  if (state != UTF8_ACCEPT)
+  {
+    return state;
+  }
+
+  done = len >= 64 ? lws_utf8_block(NULL, s, len, 0) : 0;
+  if (done == (size_t)-1)
+  {
+    return UTF8_REJECT;
+  }
+
+  restart = lws_utf8_restart(s, done);
+  return lws_utf8_validate_scalar(UTF8_ACCEPT, s + restart, len - restart);
+}
+
+uint32_t lws_unmask_utf8(char *dst, const char *src, size_t len, const unsigned char *mask, size_t offset, uint32_t state)
+{
+  uint32_t codepoint = 0;
+  size_t done, restart, i, n;
+
+  while (state != UTF8_ACCEPT && state != UTF8_REJECT && len > 0)
+  {
+    *dst = *src++ ^ mask[offset++ & 3];
+    decode(&state, &codepoint, (uint8_t)*dst++);
+    len--;
+  }
+  if (state != UTF8_ACCEPT)
+  {
+    return state;
+  }
+
+  done = len >= 64 ? lws_utf8_block(dst, (const uint8_t *)src, len, lws_mask32(mask, offset)) : 0;
+  if (done == (size_t)-1)
+  {
+    return UTF8_REJECT;
+  }
+
+  //whatever the vector kernel left is unmasked and validated chunk by chunk while hot
+  restart = lws_utf8_restart((const uint8_t *)dst, done);
+  for (i = done; ; restart = i)
+  {
+    n = len - i > UNMASK_CHUNK_LENGTH ? UNMASK_CHUNK_LENGTH : len - i;
+    lws_unmask(dst + i, src + i, n, mask, offset + i);
+    i += n;
+    state = lws_utf8_validate_scalar(state, (const uint8_t *)dst + restart, i - restart);
+    if (i == len || state == UTF8_REJECT)
+    {
+      break;
+    }
+  }
+
+  return state;
+}
@@ -20,9 +20,10 @@
 #include "websock.h"
 #include <stdio.h>
 #include <stdlib.h>
-
-#define UTF8_ACCEPT 0
-#define UTF8_REJECT 1
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 //these functions assume little endian machine as they're only used on windows
 uint16_t
@@ -60,57 +61,185 @@ uint64_t lws_be64toh(uint64_t x)
          (x << 56);
 }
 
-int validate_utf8_sequence(uint8_t *s)
+int validate_utf8_sequence(const uint8_t *s, size_t len)
 {
-  uint32_t codepoint;
-  uint32_t state = 0;
+  return lws_utf8_validate(UTF8_ACCEPT, s, len) == UTF8_ACCEPT;
+}
 
-  for (; *s; ++s)
-  {
-    decode(&state, &codepoint, *s);
-  }
+static void *lws_libc_malloc(void *ctx, size_t size)
+{
+  return malloc(size);
+}
 
-  return state == UTF8_ACCEPT;
+static void *lws_libc_realloc(void *ctx, void *ptr, size_t size)
+{
+  return realloc(ptr, size);
 }
 
+static void lws_libc_free(void *ctx, void *ptr)
+{
+  free(ptr);
+}
+
+const libwebsock_allocator lws_libc_allocator = {lws_libc_malloc, lws_libc_realloc, lws_libc_free, NULL};
+libwebsock_allocator lws_default_allocator = {lws_libc_malloc, lws_libc_realloc, lws_libc_free, NULL};
+
+/*
+ * lws_malloc and friends allocate from the library-wide default allocator and
+ * are used where no client state is at hand.  lws_state_* use the allocator
+ * the state was created with.  None of them exit on failure; they return NULL
+ * and the caller fails the connection or the call.
+ */
 void *
 lws_calloc(size_t size)
 {
-  void *alloc = calloc(1, size);
-  if (!alloc)
+  void *alloc = lws_default_allocator.malloc_fn(lws_default_allocator.ctx, size);
+  if (alloc)
   {
-    fprintf(stderr, "Failed calloc!  Exiting.\n");
-    exit(-1);
+    memset(alloc, 0, size);
   }
-
   return alloc;
 }
 
 void *
 lws_malloc(size_t size)
 {
-  void *alloc = malloc(size);
-  if (!alloc)
+  return lws_default_allocator.malloc_fn(lws_default_allocator.ctx, size);
+}
+
+void lws_free(void *ptr)
+{
+  if (ptr)
   {
-    fprintf(stderr, "Failed malloc!  Exiting.\n");
-    exit(-1);
+    lws_default_allocator.free_fn(lws_default_allocator.ctx, ptr);
+  }
+}
+
+void *
+lws_realloc(void *ptr, size_t size)
+{
+  return lws_default_allocator.realloc_fn(lws_default_allocator.ctx, ptr, size);
+}
+
+void *
+lws_state_calloc(libwebsock_client_state *state, size_t size)
+{
+  void *alloc = state->allocator.malloc_fn(state->allocator.ctx, size);
+  if (alloc)
+  {
+    memset(alloc, 0, size);
   }
   return alloc;
 }
 
-void lws_free(void *ptr)
+void *
+lws_state_malloc(libwebsock_client_state *state, size_t size)
 {
-  free(ptr);
+  return state->allocator.malloc_fn(state->allocator.ctx, size);
+}
+
+void lws_state_free(libwebsock_client_state *state, void *ptr)
+{
+  if (ptr)
+  {
+    state->allocator.free_fn(state->allocator.ctx, ptr);
+  }
 }
 
 void *
-lws_realloc(void *ptr, size_t size)
+lws_state_realloc(libwebsock_client_state *state, void *ptr, size_t size)
+{
+  return state->allocator.realloc_fn(state->allocator.ctx, ptr, size);
+}
+
+/*
+ * lws_message_* allocate message payloads: the reassembly buffer, inflated
+ * and decoded messages and the copies handed to onmessage_batch.  They use
+ * the state's message allocator, which is the state allocator unless
+ * libwebsock_set_message_allocator was called.
+ */
+void *
+lws_message_malloc(libwebsock_client_state *state, size_t size)
+{
+  return state->message_allocator.malloc_fn(state->message_allocator.ctx, size);
+}
+
+void *
+lws_message_realloc(libwebsock_client_state *state, void *ptr, size_t size)
+{
+  return state->message_allocator.realloc_fn(state->message_allocator.ctx, ptr, size);
+}
+
+void lws_message_free(libwebsock_client_state *state, void *ptr)
+{
+  if (ptr)
+  {
+    state->message_allocator.free_fn(state->message_allocator.ctx, ptr);
+  }
+}
+
+/*
+ * Called whenever a delivered message is no longer referenced.  With a
+ * reset hook, the buffers kept for the next message are dropped and the
+ * message allocator is reset, unless the batch still holds payloads or a
+ * fragmented message is being reassembled.
+ */
+void lws_message_done(libwebsock_client_state *state)
 {
-  void *new = realloc(ptr, size);
-  if (!new)
+  if (state->message_reset == NULL || state->batch_len > 0 || (state->flags & STATE_RECEIVING_FRAGMENT))
   {
-    fprintf(stderr, "Failed realloc!  Exiting.\n");
-    exit(-1);
+    return;
   }
-  return new;
+  lws_message_free(state, state->message_data);
+  state->message_data = NULL;
+  state->message_sz = 0;
+  state->message_len = 0;
+  if (state->deflate != NULL)
+  {
+    lws_inflate_release(state);
+  }
+  state->message_reset(state->message_allocator.ctx);
+}
+
+/*
+ * Fills buf from /dev/urandom.  Only used for handshake keys and seeding,
+ * so a read per call is fine; if the device can't be read, falls back to
+ * mixing the clock, pid and a stack address.
+ */
+void lws_random_bytes(void *buf, size_t len)
+{
+  unsigned char *out = (unsigned char *)buf;
+  uint64_t seed;
+  ssize_t n;
+  int fd;
+
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd != -1)
+  {
+    while (len > 0 && (n = read(fd, out, len)) > 0)
+    {
+      out += n;
+      len -= n;
+    }
+    close(fd);
+  }
+
+  seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&seed ^ (uint64_t)clock();
+  while (len > 0)
+  {
+    *out++ = lws_prng_next(&seed) & 0xff;
+    len--;
+  }
+}
+
+//xorshift64*, cheap enough to draw a fresh mask key for every frame
+uint32_t lws_prng_next(uint64_t *state)
+{
+  uint64_t x = *state ? *state : 0x9e3779b97f4a7c15ULL;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
 }
@@ -19,9 +19,14 @@
 
 #ifndef UTIL_H_
 #define UTIL_H_
+#include <stddef.h>
 #include <stdint.h>
+#include "types.h"
 
-int validate_utf8_sequence(uint8_t *s);
+extern const libwebsock_allocator lws_libc_allocator;
+extern libwebsock_allocator lws_default_allocator;
+
+int validate_utf8_sequence(const uint8_t *s, size_t len);
 uint16_t lws_htobe16(uint16_t x);
 uint16_t lws_be16toh(uint16_t x);
 uint64_t lws_htobe64(uint64_t x);
@@ -30,4 +35,14 @@ void *lws_malloc(size_t size);
 void *lws_calloc(size_t size);
 void *lws_realloc(void *ptr, size_t size);
 void lws_free(void *ptr);
+void *lws_state_malloc(libwebsock_client_state *state, size_t size);
+void *lws_state_calloc(libwebsock_client_state *state, size_t size);
+void *lws_state_realloc(libwebsock_client_state *state, void *ptr, size_t size);
+void lws_state_free(libwebsock_client_state *state, void *ptr);
+void *lws_message_malloc(libwebsock_client_state *state, size_t size);
+void *lws_message_realloc(libwebsock_client_state *state, void *ptr, size_t size);
+void lws_message_free(libwebsock_client_state *state, void *ptr);
+void lws_message_done(libwebsock_client_state *state);
+void lws_random_bytes(void *buf, size_t len);
+uint32_t lws_prng_next(uint64_t *state);
 #endif /* UTIL_H_ */
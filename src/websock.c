@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -37,9 +38,45 @@
 
 #define MAX_SUB_PROTOCOL_LENGTH 1024
 
+//returns 0, or the close code to fail the connection with
+static inline unsigned short libwebsock_reserve_rawdata(libwebsock_client_state *state, libwebsock_frame *frame)
+{
+	size_t new_size;
+	char *new_data;
+
+	if (frame->size > frame->rawdata_sz)
+	{
+		//a frame that doesn't fit in the address space has to be streamed
+		if (frame->size > SIZE_MAX / 2)
+		{
+			return WS_CLOSE_MESSAGE_TOO_BIG;
+		}
+
+		new_size = frame->rawdata_sz > 0 ? frame->rawdata_sz : FRAME_CHUNK_LENGTH;
+		while (new_size < frame->size)
+		{
+			new_size <<= 1;
+		}
+		new_data = (char *)lws_state_realloc(state, frame->rawdata, new_size);
+		if (new_data == NULL)
+		{
+			return WS_CLOSE_UNEXPECTED_ERROR;
+		}
+		frame->rawdata = new_data;
+		frame->rawdata_sz = new_size;
+	}
+	return 0;
+}
+
+/*
+ * Byte-wise header reader for headers split across reads.  Returns 1 once
+ * the header is complete, 0 if more bytes are needed and -1 for a 64-bit
+ * length with its most significant bit set.
+ */
 static inline int libwebsock_read_header(libwebsock_frame *frame)
 {
-	int i, new_size;
+	int i;
+	uint64_t len_64_be;
 	enum WS_FRAME_STATE state;
 
 	state = frame->state;
@@ -54,7 +91,9 @@ static inline int libwebsock_read_header(libwebsock_frame *frame)
 	case sw_got_two:
 		frame->mask_offset = 2;
 		frame->fin = (*(frame->rawdata) & 0x80) == 0x80 ? 1 : 0;
+		frame->rsv = *(frame->rawdata) & 0x70;
 		frame->opcode = *(frame->rawdata) & 0xf;
+		frame->masked = (*(frame->rawdata + 1) & 0x80) == 0x80 ? 1 : 0;
 		frame->payload_len_short = *(frame->rawdata + 1) & 0x7f;
 		frame->state = sw_got_short_len;
 	case sw_got_short_len:
@@ -66,7 +105,7 @@ static inline int libwebsock_read_header(libwebsock_frame *frame)
 				return 0;
 			}
 			frame->mask_offset += 2;
-			frame->payload_offset = frame->mask_offset + MASK_LENGTH;
+			frame->payload_offset = frame->mask_offset + (frame->masked ? MASK_LENGTH : 0);
 			frame->payload_len = ntohs(
 				*((unsigned short int *)(frame->rawdata + 2)));
 			frame->state = sw_got_full_len;
@@ -77,13 +116,18 @@ static inline int libwebsock_read_header(libwebsock_frame *frame)
 				return 0;
 			}
 			frame->mask_offset += 8;
-			frame->payload_offset = frame->mask_offset + MASK_LENGTH;
-			frame->payload_len = ntohl(*((unsigned int *)(frame->rawdata + 6)));
+			frame->payload_offset = frame->mask_offset + (frame->masked ? MASK_LENGTH : 0);
+			memcpy(&len_64_be, frame->rawdata + 2, sizeof(len_64_be));
+			frame->payload_len = be64toh(len_64_be);
+			if (frame->payload_len >> 63)
+			{
+				return -1;
+			}
 			frame->state = sw_got_full_len;
 			break;
 		default:
 			frame->payload_len = frame->payload_len_short;
-			frame->payload_offset = frame->mask_offset + MASK_LENGTH;
+			frame->payload_offset = frame->mask_offset + (frame->masked ? MASK_LENGTH : 0);
 			frame->state = sw_got_full_len;
 			break;
 		}
@@ -94,31 +138,142 @@ static inline int libwebsock_read_header(libwebsock_frame *frame)
 		}
 		for (i = 0; i < MASK_LENGTH; i++)
 		{
-			frame->mask[i] = *(frame->rawdata + frame->mask_offset + i) & 0xff;
+			//an unmasked frame unmasks with a zero key
+			frame->mask[i] = frame->masked ? *(frame->rawdata + frame->mask_offset + i) & 0xff : 0;
 		}
 		frame->state = sw_loaded_mask;
 		frame->size = frame->payload_offset + frame->payload_len;
-		if (frame->size > frame->rawdata_sz)
-		{
-			new_size = frame->size;
-			new_size--;
-			new_size |= new_size >> 1;
-			new_size |= new_size >> 2;
-			new_size |= new_size >> 4;
-			new_size |= new_size >> 8;
-			new_size |= new_size >> 16;
-			new_size++;
-			frame->rawdata_sz = new_size;
-			frame->rawdata = (char *)lws_realloc(frame->rawdata, new_size);
-		}
 		return 1;
 	case sw_loaded_mask:
+	case sw_streaming:
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Fast path for the common case where the whole frame header is available in
+ * the caller's buffer.  Decodes fin/opcode/length and the mask straight from
+ * buf without touching rawdata.  Returns the header length, 0 if the header
+ * is split across reads and the byte-wise state machine has to take over, or
+ * -1 for a 64-bit length with its most significant bit set, which the
+ * protocol forbids and which would wrap the frame size.
+ */
+static inline int libwebsock_decode_header(libwebsock_frame *frame, const char *buf, size_t len)
+{
+	unsigned short int len_16_be;
+	uint64_t len_64_be;
+	int header_len;
+
+	if (len < 2)
+	{
+		return 0;
+	}
+
+	frame->payload_len_short = *(buf + 1) & 0x7f;
+	switch (frame->payload_len_short)
+	{
+	case 126:
+		frame->mask_offset = 4;
+		break;
+	case 127:
+		frame->mask_offset = 10;
+		break;
+	default:
+		frame->mask_offset = 2;
+		break;
+	}
+
+	frame->masked = (*(buf + 1) & 0x80) == 0x80 ? 1 : 0;
+	header_len = frame->mask_offset + (frame->masked ? MASK_LENGTH : 0);
+	if (len < (size_t)header_len)
+	{
+		return 0;
+	}
+
+	frame->fin = (*buf & 0x80) == 0x80 ? 1 : 0;
+	frame->rsv = *buf & 0x70;
+	frame->opcode = *buf & 0xf;
+	frame->payload_offset = header_len;
+	switch (frame->payload_len_short)
+	{
+	case 126:
+		memcpy(&len_16_be, buf + 2, sizeof(len_16_be));
+		frame->payload_len = ntohs(len_16_be);
+		break;
+	case 127:
+		memcpy(&len_64_be, buf + 2, sizeof(len_64_be));
+		frame->payload_len = be64toh(len_64_be);
+		if (frame->payload_len >> 63)
+		{
+			return -1;
+		}
+		break;
+	default:
+		frame->payload_len = frame->payload_len_short;
+		break;
+	}
+	if (frame->masked)
+	{
+		memcpy(frame->mask, buf + frame->mask_offset, MASK_LENGTH);
+	}
+	else
+	{
+		memset(frame->mask, 0, MASK_LENGTH);
+	}
+	frame->size = frame->payload_offset + frame->payload_len;
+	return header_len;
+}
+
+/*
+ * Index into the frame lookup table for a frame starting with first_byte.
+ * The RSV bits claimed by negotiated extensions mark the first frame of a
+ * message they transformed, so they are masked off there and left to fail
+ * the frame anywhere else.
+ */
+static inline unsigned int libwebsock_frame_index(libwebsock_client_state *state, unsigned int first_byte)
+{
+	if (state->flags & STATE_RECEIVING_FRAGMENT)
+	{
+		return 256 | first_byte;
+	}
+	if ((first_byte & 0x08) == 0)
+	{
+		return first_byte & ~state->extension_rsv;
+	}
+	return first_byte;
+}
+
+/*
+ * Checks a data frame's declared length against the state's limits (0 means
+ * unlimited) before any of its payload is buffered.  Fragments count towards
+ * max_message_size together with what has already been received.
+ */
+static inline int libwebsock_frame_too_big(libwebsock_client_state *state, libwebsock_frame *frame)
+{
+	size_t message_len;
+
+	if (frame->opcode & 0x8)
+	{
+		return 0;
+	}
+
+	if (state->max_frame_size > 0 && frame->payload_len > state->max_frame_size)
+	{
 		return 1;
 	}
+
+	message_len = (state->flags & STATE_RECEIVING_FRAGMENT) ? state->message_len : 0;
+	if (state->max_message_size > 0 && message_len + frame->payload_len > state->max_message_size)
+	{
+		return 1;
+	}
+
 	return 0;
 }
 
-void libwebsock_populate_close_info_from_frame(libwebsock_close_info **info,
+void libwebsock_populate_close_info_from_frame(libwebsock_client_state *state,
+											   libwebsock_close_info **info,
 											   libwebsock_frame *close_frame)
 {
 	unsigned short code_be;
@@ -127,8 +282,13 @@ void libwebsock_populate_close_info_from_frame(libwebsock_close_info **info,
 		return;
 	}
 
-	libwebsock_close_info *new_info = (libwebsock_close_info *)lws_calloc(
+	libwebsock_close_info *new_info = (libwebsock_close_info *)lws_state_calloc(state,
 		sizeof(libwebsock_close_info));
+	if (new_info == NULL)
+	{
+		//the close handshake still goes ahead, only the reason is lost
+		return;
+	}
 
 	memcpy(&code_be, close_frame->rawdata + close_frame->payload_offset, 2);
 	int at_most = close_frame->payload_len - 2;
@@ -149,6 +309,7 @@ int libwebsock_error(libwebsock_client_state *state,
 
 	logdebug("failing connection with close code %d...", close_code);
 	state->flags |= STATE_PROCESSING_ERROR;
+	libwebsock_flush_batch(state);
 
 	if (state->onerror)
 	{
@@ -162,114 +323,382 @@ int libwebsock_error(libwebsock_client_state *state,
 	return retval;
 }
 
+/*
+ * Queues a completed message for onmessage_batch.  owned is a buffer the
+ * batch takes over and frees after delivery, or NULL when the payload lives
+ * in the caller's receive buffer.  Returns -1 if the batch can't grow.
+ */
+static int libwebsock_batch_message(libwebsock_client_state *state, unsigned int opcode,
+									char *payload, size_t len, char *owned)
+{
+	size_t new_sz;
+	libwebsock_message *msgs;
+	char **owned_ptrs;
+
+	if (state->batch_len == state->batch_sz)
+	{
+		new_sz = state->batch_sz > 0 ? state->batch_sz << 1 : 16;
+		msgs = (libwebsock_message *)lws_state_realloc(state, state->batch, new_sz * sizeof(libwebsock_message));
+		if (msgs == NULL)
+		{
+			return -1;
+		}
+		state->batch = msgs;
+		owned_ptrs = (char **)lws_state_realloc(state, state->batch_owned, new_sz * sizeof(char *));
+		if (owned_ptrs == NULL)
+		{
+			return -1;
+		}
+		state->batch_owned = owned_ptrs;
+		state->batch_sz = new_sz;
+	}
+
+	state->batch[state->batch_len].opcode = opcode;
+	state->batch[state->batch_len].payload_len = len;
+	state->batch[state->batch_len].payload = payload;
+	state->batch_owned[state->batch_len] = owned;
+	state->batch_len++;
+	return 0;
+}
+
+/*
+ * Hands every queued message to onmessage_batch in one call.  Run at the end
+ * of each receive call, and before control frames and errors are reported so
+ * callbacks still see events in wire order.
+ */
+int libwebsock_flush_batch(libwebsock_client_state *state)
+{
+	size_t n, count = state->batch_len;
+	int retval = 0;
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	state->batch_len = 0;
+	logdebug("calling the onmessage_batch callback with %zu messages", count);
+	retval = state->onmessage_batch(state, state->batch, count);
+
+	for (n = 0; n < count; n++)
+	{
+		lws_message_free(state, state->batch_owned[n]);
+	}
+	lws_message_done(state);
+	return retval;
+}
+
+/*
+ * Runs a message that has RSV bits set through the receive pipeline,
+ * inflating it first if it is compressed, validates it if it is text and
+ * hands it to whichever message callback is set, onmessage_chunk getting it
+ * as a single chunk.  data has a spare byte at data[len].
+ */
+static int libwebsock_dispatch_decoded(libwebsock_client_state *state, unsigned int opcode, unsigned int rsv,
+									   char *data, size_t len)
+{
+	unsigned short close_code = 0;
+	libwebsock_message msg;
+	char *payload = data, *inflated = NULL, *owned;
+	size_t payload_len = len;
+	int retval = 0;
+
+	if ((rsv & WS_FRAGMENT_RSV1) && (state->flags & STATE_DEFLATE))
+	{
+		close_code = lws_inflate_message(state, data, len, &payload, &payload_len);
+		inflated = close_code == 0 ? payload : NULL;
+	}
+	if (close_code == 0)
+	{
+		close_code = lws_extension_decode(state, opcode, rsv, &payload, &payload_len);
+	}
+	if (close_code == 0 && state->max_message_size > 0 && payload_len > state->max_message_size)
+	{
+		close_code = WS_CLOSE_MESSAGE_TOO_BIG;
+	}
+	if (close_code == WS_CLOSE_UNEXPECTED_ERROR)
+	{
+		return libwebsock_fail_no_memory(state);
+	}
+	if (close_code != 0)
+	{
+		logerror("unable to decode message");
+		return libwebsock_error(state, close_code);
+	}
+	if (opcode == WS_OPCODE_TEXT && lws_utf8_validate(UTF8_ACCEPT, (const uint8_t *)payload, payload_len) != UTF8_ACCEPT)
+	{
+		logerror("Error validating UTF-8 sequence.");
+		return libwebsock_error(state, WS_CLOSE_WRONG_TYPE);
+	}
+	payload[payload_len] = '\0';
+
+	if (state->onmessage_batch)
+	{
+		//the batch keeps the inflate buffer, anything else can change before it is flushed
+		if (payload == inflated)
+		{
+			owned = lws_inflate_detach(state);
+		}
+		else
+		{
+			owned = (char *)lws_message_malloc(state, payload_len + 1);
+			if (owned == NULL)
+			{
+				return libwebsock_fail_no_memory(state);
+			}
+			memcpy(owned, payload, payload_len + 1);
+		}
+		if (libwebsock_batch_message(state, opcode, owned, payload_len, owned) == -1)
+		{
+			lws_message_free(state, owned);
+			return libwebsock_fail_no_memory(state);
+		}
+		if (inflated != NULL)
+		{
+			lws_inflate_trim(state);
+		}
+		return 0;
+	}
+
+	if (state->onmessage_chunk)
+	{
+		retval = state->onmessage_chunk(state, opcode, payload, payload_len, 1, 1);
+	}
+	else if (state->onmessage)
+	{
+		msg.opcode = opcode;
+		msg.payload_len = payload_len;
+		msg.payload = payload;
+		logdebug("calling the onmessage callback");
+		retval = state->onmessage(state, &msg);
+	}
+	if (inflated != NULL)
+	{
+		lws_inflate_trim(state);
+	}
+	return retval;
+}
+
 int libwebsock_dispatch_message(libwebsock_client_state *state)
 {
 	logdebug("dispatching message...");
 
-	unsigned int current_payload_len;
-	unsigned long long message_payload_len;
-	int message_opcode, i;
 	libwebsock_frame *current = state->current_frame;
-	char *message_payload, *message_payload_orig, *rawdata_ptr;
 	int retval = 0;
-	libwebsock_message *msg = NULL;
+	unsigned short close_code;
+	libwebsock_message msg;
+
+	if (current == NULL)
+	{
+		logerror("Somehow, null pointer passed to libwebsock_dispatch_message.");
+		return -1;
+	}
 
-	state->flags &= ~STATE_RECEIVING_FRAGMENT;
 	if (state->flags & STATE_SENT_CLOSE_FRAME)
 	{
 		logdebug("nothing to do as close frame is already sent");
+		state->flags &= ~STATE_RECEIVING_FRAGMENT;
+		state->message_rsv = 0;
+		libwebsock_free_all_frames(state);
+		state->current_frame = NULL;
 		return retval;
 	}
 
-	libwebsock_frame *first = NULL;
-	if (current == NULL)
+	close_code = libwebsock_append_fragment(state, current);
+	if (close_code == WS_CLOSE_UNEXPECTED_ERROR)
 	{
-		logerror("Somehow, null pointer passed to libwebsock_dispatch_message.");
-		return -1;
+		return libwebsock_fail_no_memory(state);
 	}
-
-	message_payload_len = 0;
-	for (; current->prev_frame != NULL; current = current->prev_frame)
+	if (close_code != 0 || state->message_utf8_state != UTF8_ACCEPT)
 	{
-		message_payload_len += current->payload_len;
+		logerror("Error validating UTF-8 sequence.");
+		return libwebsock_error(state, WS_CLOSE_WRONG_TYPE);
 	}
 
-	message_payload_len += current->payload_len;
-	first = current;
-	message_opcode = current->opcode;
-	message_payload = (char *)lws_malloc(message_payload_len + 1);
-	message_payload_orig = message_payload;
+	state->flags &= ~STATE_RECEIVING_FRAGMENT;
+	libwebsock_cleanup_frames(state, current);
+	state->current_frame = NULL;
 
-	for (; current != NULL; current = current->next_frame)
+	if (state->message_rsv != 0)
 	{
-		current_payload_len = current->payload_len;
-		rawdata_ptr = current->rawdata + current->payload_offset;
-		for (i = 0; i < current_payload_len; i++)
+		retval = libwebsock_dispatch_decoded(state, state->message_opcode, state->message_rsv, state->message_data,
+											 state->message_len);
+		state->message_rsv = 0;
+	}
+	else if (state->onmessage_batch)
+	{
+		//the batch takes the buffer, the next message starts a new one
+		state->message_data[state->message_len] = '\0';
+		if (libwebsock_batch_message(state, state->message_opcode, state->message_data,
+									 state->message_len, state->message_data) == -1)
 		{
-			*message_payload++ = *rawdata_ptr++ ^ current->mask[i & 3];
+			return libwebsock_fail_no_memory(state);
 		}
+		state->message_data = NULL;
+		state->message_sz = 0;
+		state->message_len = 0;
+		return 0;
+	}
+	else if (state->onmessage)
+	{
+		//hand onmessage the buffer the fragments were unmasked into
+		state->message_data[state->message_len] = '\0';
+		msg.opcode = state->message_opcode;
+		msg.payload_len = state->message_len;
+		msg.payload = state->message_data;
+		logdebug("calling the onmessage callback");
+		retval = state->onmessage(state, &msg);
 	}
 
-	*(message_payload) = '\0';
+	//keep a modest reassembly buffer around for the next message
+	if (state->message_sz > FRAME_POOL_MAX_RAWDATA)
+	{
+		lws_message_free(state, state->message_data);
+		state->message_data = NULL;
+		state->message_sz = 0;
+	}
+	state->message_len = 0;
+	lws_message_done(state);
+	return retval;
+}
 
-	if (message_opcode == WS_OPCODE_TEXT)
+/*
+ * Dispatches a complete, unfragmented data frame that sits entirely in the
+ * caller's receive buffer.  The payload is unmasked down over its own header,
+ * so it starts at frame_data and leaves room for the terminating NUL without
+ * touching any byte past the end of the frame.  onmessage gets a view into the
+ * receive buffer; nothing is allocated.
+ */
+static int libwebsock_dispatch_message_inplace(libwebsock_client_state *state, libwebsock_frame *frame, char *frame_data)
+{
+	logdebug("dispatching message in place...");
+
+	char *rawdata_ptr = frame_data + frame->payload_offset;
+	libwebsock_message msg;
+	int retval;
+
+	if (state->flags & STATE_SENT_CLOSE_FRAME)
+	{
+		logdebug("nothing to do as close frame is already sent");
+		return 0;
+	}
+
+	if (frame->rsv != 0)
 	{
-		if (!validate_utf8_sequence((uint8_t *)message_payload_orig))
+		lws_unmask(frame_data, rawdata_ptr, frame->payload_len, frame->mask, 0);
+		retval = libwebsock_dispatch_decoded(state, frame->opcode, frame->rsv, frame_data, frame->payload_len);
+		lws_message_done(state);
+		return retval;
+	}
+
+	if (frame->opcode == WS_OPCODE_TEXT)
+	{
+		if (lws_unmask_utf8(frame_data, rawdata_ptr, frame->payload_len, frame->mask, 0, UTF8_ACCEPT) != UTF8_ACCEPT)
 		{
 			logerror("Error validating UTF-8 sequence.");
-			lws_free(message_payload_orig);
 			return libwebsock_error(state, WS_CLOSE_WRONG_TYPE);
 		}
 	}
+	else
+	{
+		lws_unmask(frame_data, rawdata_ptr, frame->payload_len, frame->mask, 0);
+	}
+	frame_data[frame->payload_len] = '\0';
 
-	libwebsock_cleanup_frames(state, first);
-	state->current_frame = NULL;
+	if (state->onmessage_batch)
+	{
+		if (libwebsock_batch_message(state, frame->opcode, frame_data, frame->payload_len, NULL) == -1)
+		{
+			return libwebsock_fail_no_memory(state);
+		}
+		return 0;
+	}
 
-	msg = (libwebsock_message *)lws_malloc(sizeof(libwebsock_message));
-	msg->opcode = message_opcode;
-	msg->payload_len = message_payload_len;
-	msg->payload = lws_calloc(message_payload_len + 1);
-	memcpy(msg->payload, message_payload_orig, message_payload_len);
-	msg->payload[message_payload_len] = '\0';
+	msg.opcode = frame->opcode;
+	msg.payload_len = frame->payload_len;
+	msg.payload = frame_data;
 
 	if (state->onmessage)
 	{
 		logdebug("calling the onmessage callback");
-		retval = state->onmessage(state, msg);
+		return state->onmessage(state, &msg);
 	}
 
-	lws_free(message_payload_orig);
-	lws_free(msg->payload);
-	lws_free(msg);
-	return retval;
+	return 0;
 }
 
-void libwebsock_cleanup_outdata(libwebsock_client_state *state)
+/*
+ * Passes len bytes of the current data frame's payload, sitting at data in the
+ * receive buffer, to onmessage_chunk after unmasking them in place.  Text is
+ * validated incrementally; an invalid sequence fails the connection with 1007
+ * even though earlier chunks of the message have already been delivered.
+ */
+static int libwebsock_dispatch_chunk(libwebsock_client_state *state, char *data, size_t len)
 {
-	if (state->out_data)
+	libwebsock_frame *current = state->current_frame;
+	uint64_t offset = current->rawdata_idx - current->payload_offset;
+	int is_first, is_final;
+	int retval = 0;
+
+	is_first = (state->flags & STATE_RECEIVING_FRAGMENT) == 0 && offset == 0;
+	if (is_first)
+	{
+		state->message_opcode = current->opcode;
+		state->message_utf8_state = UTF8_ACCEPT;
+		state->message_len = 0;
+	}
+
+	current->rawdata_idx += len;
+	state->message_len += len;
+	is_final = current->fin && current->rawdata_idx == current->size;
+
+	if (state->message_opcode == WS_OPCODE_TEXT)
 	{
-		if (state->out_data->data)
+		state->message_utf8_state = lws_unmask_utf8(data, data, len, current->mask, offset, state->message_utf8_state);
+		if (state->message_utf8_state == UTF8_REJECT || (is_final && state->message_utf8_state != UTF8_ACCEPT))
 		{
-			lws_free((void *)state->out_data->data);
-			state->out_data->data = NULL;
+			logerror("Error validating UTF-8 sequence.");
+			return libwebsock_error(state, WS_CLOSE_WRONG_TYPE);
 		}
-		state->out_data->data_sz = 0;
-		lws_free((void *)state->out_data);
-		state->out_data = NULL;
 	}
+	else
+	{
+		lws_unmask(data, data, len, current->mask, offset);
+	}
+
+	if ((state->flags & STATE_SENT_CLOSE_FRAME) == 0)
+	{
+		retval = state->onmessage_chunk(state, state->message_opcode, data, len, is_first, is_final);
+	}
+
+	//frame done, reuse it for whatever comes next
+	current = state->current_frame;
+	if (current != NULL && current->rawdata_idx == current->size)
+	{
+		if (current->fin)
+		{
+			state->flags &= ~STATE_RECEIVING_FRAGMENT;
+		}
+		else
+		{
+			state->flags |= STATE_RECEIVING_FRAGMENT;
+		}
+		current->state = sw_start;
+		current->rawdata_idx = 0;
+	}
+
+	return retval;
 }
 
-int libwebsock_make_fragment(libwebsock_client_state *state, const char *data,
-							 unsigned int len, int flags)
+//drops all output that has not been consumed yet
+void libwebsock_cleanup_outdata(libwebsock_client_state *state)
 {
+	lws_output_release_all(state);
+}
 
-	unsigned int *payload_len_32_be;
-	unsigned short int *payload_len_short_be;
-	unsigned char finNopcode, payload_len_small;
-	unsigned int payload_offset = 2;
-	unsigned int frame_size, current_size = 0;
-
-	logdebug("called with len %u, flags are as follows:", len);
+static int libwebsock_check_sendable(libwebsock_client_state *state, size_t len)
+{
+	logdebug("called with len %zu, flags are as follows:", len);
 
 	if ((state->flags & STATE_SENT_CLOSE_FRAME) != 0)
 	{
@@ -299,84 +728,277 @@ int libwebsock_make_fragment(libwebsock_client_state *state, const char *data,
 	{
 		logdebug("|STATE_PROCESSING_ERROR");
 	}
-
-	if ((state->flags & STATE_SENT_CLOSE_FRAME) != 0 && (state->flags & STATE_RECEIVED_CLOSE_FRAME) != 0)
+
+	if ((state->flags & STATE_SENT_CLOSE_FRAME) != 0 && (state->flags & STATE_RECEIVED_CLOSE_FRAME) != 0)
+	{
+		logerror("failed to make the fragment as the close frame has been sent/received");
+		return -1;
+	}
+
+	if ((state->flags & STATE_CONNECTED) == 0)
+	{
+		logerror("failed to make the fragment as the client state is not connected");
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t libwebsock_make_fragment(libwebsock_client_state *state, const char *data,
+								 size_t len, int flags)
+{
+	int rsv;
+
+	if (libwebsock_check_sendable(state, len) == -1)
+	{
+		return -1;
+	}
+	rsv = lws_extension_encode(state, &data, &len, flags);
+	if (rsv == -1)
+	{
+		return -1;
+	}
+	if (lws_deflate_wants(state, len, flags))
+	{
+		return lws_deflate_queue_message(state, data, len, flags | rsv);
+	}
+	return lws_output_queue_copy(state, data, len, flags | rsv);
+}
+
+/*
+ * Like libwebsock_make_fragment, but only the header is written: the frame
+ * goes out straight from data, which must stay untouched until release is
+ * called with release_arg once the last byte has been consumed or the
+ * output is dropped.  On failure -1 is returned and release is not called.
+ */
+ssize_t libwebsock_make_fragment_zerocopy(libwebsock_client_state *state, const char *data, size_t len,
+										  int flags, libwebsock_release_fn release, void *release_arg)
+{
+	const char *out = data;
+	size_t out_len = len;
+	ssize_t retval;
+	int compress, rsv;
+
+	if (libwebsock_check_sendable(state, len) == -1)
+	{
+		return -1;
+	}
+
+	rsv = lws_extension_encode(state, &out, &out_len, flags);
+	if (rsv == -1)
+	{
+		return -1;
+	}
+	compress = lws_deflate_wants(state, out_len, flags);
+	if ((state->flags & STATE_CLIENT) == 0 && !compress && out == data)
+	{
+		return lws_output_queue_ref(state, data, len, flags | rsv, release, release_arg);
+	}
+
+	//masking, compressing and encoding all copy, so data is free right away
+	if (compress)
+	{
+		retval = lws_deflate_queue_message(state, out, out_len, flags | rsv);
+	}
+	else
+	{
+		retval = lws_output_queue_copy(state, out, out_len, flags | rsv);
+	}
+	if (retval != -1 && release != NULL)
+	{
+		release(release_arg);
+	}
+	return retval;
+}
+
+/*
+ * Returns space for a payload of up to max_len bytes right in the output
+ * queue, so it can be serialized in place instead of being built elsewhere
+ * and copied.  libwebsock_commit then sends the first len bytes of it as one
+ * complete message.  Frames sent in between, the automatic pong included,
+ * are queued ahead of it.
+ *
+ * The payload goes out exactly as written: it bypasses negotiated
+ * extensions and is never compressed, which permessage-deflate allows for
+ * any message.  An extension whose encode must see every message can't be
+ * bypassed, so nothing is reserved while one is in use.  libwebsock_commit
+ * refuses what the peer would have to reject: a reserved opcode, a control
+ * frame over 125 bytes or a text payload that isn't valid UTF-8.
+ */
+char *libwebsock_reserve(libwebsock_client_state *state, size_t max_len)
+{
+	if (libwebsock_check_sendable(state, max_len) == -1)
+	{
+		return NULL;
+	}
+	if (lws_extension_encodes(state))
+	{
+		logerror("output space can't be reserved while an extension encodes messages");
+		return NULL;
+	}
+	if (state->out_reserved != NULL)
+	{
+		logerror("output space has already been reserved");
+		return NULL;
+	}
+	return lws_output_reserve_frame(state, max_len);
+}
+
+//the frame is checked like a received one before it joins the queue
+ssize_t libwebsock_commit(libwebsock_client_state *state, size_t len, int opcode)
+{
+	const char *reason = NULL;
+
+	switch (opcode)
+	{
+	case WS_OPCODE_TEXT:
+	case WS_OPCODE_BINARY:
+		if (state->flags & STATE_CONTINUOUS_FRAME_IN_PROGRESS)
+		{
+			reason = "a continous frame is in progress";
+		}
+		else if (opcode == WS_OPCODE_TEXT && state->out_reserved != NULL && len <= state->out_reserved_len &&
+				 lws_utf8_validate(UTF8_ACCEPT, (const uint8_t *)state->out_reserved, len) != UTF8_ACCEPT)
+		{
+			reason = "text payload is not valid UTF-8";
+		}
+		break;
+	case WS_OPCODE_CLOSE:
+	case WS_OPCODE_PING:
+	case WS_OPCODE_PONG:
+		if (len > 125)
+		{
+			reason = "control frame payload greater than 125 bytes";
+		}
+		break;
+	default:
+		reason = "opcode is reserved or not a complete message";
+		break;
+	}
+	if (reason != NULL)
 	{
-		logerror("failed to make the fragment as the close frame has been sent/received");
+		logerror("Invalid commit: %s.", reason);
+		lws_output_cancel_reserved(state);
 		return -1;
 	}
+	return lws_output_commit_frame(state, len, WS_FRAGMENT_FIN | opcode);
+}
 
-	if ((state->flags & STATE_CONNECTED) == 0)
+/*
+ * Encodes a server frame once so it can be queued on many connections
+ * without copying.  The caller holds the first reference and drops it with
+ * libwebsock_release_shared_frame once done queueing.
+ */
+libwebsock_shared_frame *libwebsock_make_shared_frame(const char *data, size_t len, int flags)
+{
+	libwebsock_shared_frame *frame;
+	char header[14];
+	unsigned int header_len = lws_encode_header(header, flags, len);
+
+	if (header_len == 0 || len > SIZE_MAX - sizeof(libwebsock_shared_frame) - header_len)
 	{
-		logerror("failed to make the fragment as the client state is not connected");
-		return -1;
+		return NULL;
 	}
 
-	finNopcode = flags & 0xff;
-	if (len <= 125)
+	frame = (libwebsock_shared_frame *)lws_default_allocator.malloc_fn(lws_default_allocator.ctx,
+		sizeof(libwebsock_shared_frame) + header_len + len);
+	if (frame == NULL)
 	{
-		frame_size = 2 + len;
-		payload_len_small = len & 0xff;
+		return NULL;
 	}
-	else if (len > 125 && len <= 0xffff)
+	frame->refcount = 1;
+	frame->allocator = lws_default_allocator;
+	frame->len = header_len + len;
+	memcpy(frame->data, header, header_len);
+	memcpy(frame->data + header_len, data, len);
+	return frame;
+}
+
+//connections may live on different threads, so the count is atomic
+void libwebsock_release_shared_frame(libwebsock_shared_frame *frame)
+{
+	if (frame != NULL && __atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0)
 	{
-		frame_size = 4 + len;
-		payload_len_small = 126;
-		payload_offset += 2;
+		frame->allocator.free_fn(frame->allocator.ctx, frame);
 	}
-	else if (len > 0xffff && len <= 0xfffffff0)
+}
+
+static void libwebsock_shared_frame_done(void *arg)
+{
+	libwebsock_release_shared_frame((libwebsock_shared_frame *)arg);
+}
+
+ssize_t libwebsock_queue_shared_frame(libwebsock_client_state *state, libwebsock_shared_frame *frame)
+{
+	if (libwebsock_check_sendable(state, frame->len) == -1)
 	{
-		frame_size = 10 + len;
-		payload_len_small = 127;
-		payload_offset += 8;
+		return -1;
 	}
-	else
+
+	//a client has to mask every frame with its own key
+	if (state->flags & STATE_CLIENT)
 	{
-		logerror(
-			"libwebsock does not support frame payload sizes over %u bytes long",
-			0xfffffff0);
+		logerror("shared frames can only be sent by a server");
 		return -1;
 	}
 
-	if (!state->out_data)
+	if ((frame->data[0] & 0x08) == 0 && (state->flags & STATE_CONTINUOUS_FRAME_IN_PROGRESS))
 	{
-		state->out_data = (libwebsock_string *)lws_calloc(sizeof(libwebsock_string));
-		state->out_data->data_sz = frame_size;
-		state->out_data->data = (char *)lws_calloc(frame_size);
+		logerror("Invalid call. A continous frame is in progress.");
+		return -1;
 	}
-	else
+
+	__atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+	if (lws_output_queue_encoded(state, frame->data, frame->len, libwebsock_shared_frame_done, frame) == -1)
 	{
-		current_size = state->out_data->data_sz;
-		state->out_data->data = lws_realloc(state->out_data->data, current_size + frame_size);
-		state->out_data->data_sz = current_size + frame_size;
+		libwebsock_release_shared_frame(frame);
+		return -1;
 	}
+	return frame->len;
+}
+
+/*
+ * Sends the same frame to every connection in states.  Returns how many it
+ * was queued on; a connection that can't take it is skipped.
+ */
+size_t libwebsock_broadcast(libwebsock_client_state **states, size_t count, const char *data, size_t len, int flags)
+{
+	libwebsock_shared_frame *frame = libwebsock_make_shared_frame(data, len, flags);
+	size_t n, queued = 0;
 
-	char *frame = (char *)state->out_data->data + current_size;
-	payload_len_small &= 0x7f;
-	*frame = finNopcode;
-	*(frame + 1) = payload_len_small;
-	if (payload_len_small == 126)
+	if (frame == NULL)
 	{
-		len &= 0xffff;
-		payload_len_short_be = (unsigned short *)((char *)frame + 2);
-		*payload_len_short_be = htons(len);
+		return 0;
 	}
-	if (payload_len_small == 127)
+
+	for (n = 0; n < count; n++)
 	{
-		payload_len_32_be = (unsigned int *)((char *)frame + 2);
-		*payload_len_32_be++ = 0;
-		*payload_len_32_be = htonl(len);
+		if (libwebsock_queue_shared_frame(states[n], frame) != -1)
+		{
+			queued++;
+		}
 	}
-	memcpy(frame + payload_offset, data, len);
-	return frame_size;
+
+	libwebsock_release_shared_frame(frame);
+	return queued;
 }
 
-int libwebsock_handle_recv(libwebsock_client_state *state, const char *data, size_t len)
+/*
+ * The receive loop.  With writable set, data may be changed: complete frames
+ * are unmasked and dispatched right where they sit, and streamed payloads
+ * are unmasked in place.  Without it data is only read, frames are staged
+ * and streamed payloads go through a bounce buffer.
+ */
+static int libwebsock_recv(libwebsock_client_state *state, char *data, size_t len, int writable)
 {
-	logdebug("received data of size %u", len);
+	logdebug("received data of size %zu", len);
 
 	libwebsock_frame *current = NULL;
-	int i, err, in_fragment;
+	libwebsock_frame inplace;
+	size_t i;
+	int err, transformed, header_len;
+	unsigned short close_code;
+	size_t chunk_len, n;
+	char bounce[FRAME_CHUNK_LENGTH];
 
 	if (len == 0)
 	{
@@ -420,7 +1042,7 @@ int libwebsock_handle_recv(libwebsock_client_state *state, const char *data, siz
 	};
 
 	int retval = -1;
-	const char *buf = data;
+	char *buf = data;
 	for (i = 0; i < len;)
 	{
 		if (state->flags & STATE_PROCESSING_ERROR)
@@ -435,27 +1057,173 @@ int libwebsock_handle_recv(libwebsock_client_state *state, const char *data, siz
 		}
 
 		current = state->current_frame;
+		if (writable && current == NULL && (state->flags & STATE_RECEIVING_FRAGMENT) == 0 &&
+			state->onmessage_chunk == NULL)
+		{ //whole unfragmented message in this buffer, dispatch it without staging
+			//compared against what is left after the header so nothing can wrap
+			header_len = libwebsock_decode_header(&inplace, buf, len - i);
+			if (header_len > 0 && inplace.payload_len <= len - i - header_len &&
+				libwebsock_frame_lookup_table[libwebsock_frame_index(state, *buf & 0xff)] == AA &&
+				inplace.masked == LWS_EXPECT_MASKED(state) &&
+				!libwebsock_frame_too_big(state, &inplace))
+			{
+				retval = libwebsock_dispatch_message_inplace(state, &inplace, buf);
+				buf += inplace.size;
+				i += inplace.size;
+				if (retval == -1)
+				{
+					break;
+				}
+				continue;
+			}
+		}
+
 		if (current == NULL)
 		{
-			current = (libwebsock_frame *)lws_calloc(sizeof(libwebsock_frame));
-			current->payload_len = -1;
-			current->rawdata_sz = FRAME_CHUNK_LENGTH;
-			current->rawdata = (char *)lws_calloc(FRAME_CHUNK_LENGTH);
+			current = libwebsock_new_frame(state);
+			if (current == NULL)
+			{
+				retval = libwebsock_fail_no_memory(state);
+				break;
+			}
 			state->current_frame = current;
 		}
 
-		*(current->rawdata + current->rawdata_idx++) = *buf++;
-		i++;
-
-		if (current->state != sw_loaded_mask)
+		if (current->state < sw_loaded_mask)
 		{
-			err = libwebsock_read_header(current);
-			if (err == 0)
+			header_len = 0;
+			if (current->rawdata_idx == 0)
+			{
+				header_len = libwebsock_decode_header(current, buf, len - i);
+			}
+
+			if (header_len == -1)
+			{
+				logerror("invalid 64-bit payload length");
+				retval = libwebsock_fail_and_cleanup(state);
+				continue;
+			}
+			else if (header_len > 0)
+			{
+				memcpy(current->rawdata, buf, header_len);
+				current->rawdata_idx = header_len;
+				current->state = sw_loaded_mask;
+				buf += header_len;
+				i += header_len;
+			}
+			else
+			{ //header split across reads, fall back to the byte-wise state machine
+				*(current->rawdata + current->rawdata_idx++) = *buf++;
+				i++;
+
+				err = libwebsock_read_header(current);
+				if (err == 0)
+				{
+					continue;
+				}
+				if (err == -1)
+				{
+					logerror("invalid 64-bit payload length");
+					retval = libwebsock_fail_and_cleanup(state);
+					continue;
+				}
+			}
+
+			//clients mask every frame, servers never do
+			if (current->masked != LWS_EXPECT_MASKED(state))
+			{
+				logerror("received %s frame", current->masked ? "masked" : "unmasked");
+				retval = libwebsock_error(state, WS_CLOSE_PROTOCOL_ERROR);
+				continue;
+			}
+
+			//refuse oversized frames before growing rawdata for them
+			if (libwebsock_frame_too_big(state, current))
+			{
+				logerror("frame of %llu bytes exceeds the size limit", (unsigned long long)current->payload_len);
+				retval = libwebsock_error(state, WS_CLOSE_MESSAGE_TOO_BIG);
+				continue;
+			}
+
+			if ((current->opcode & 0x8) && current->payload_len > 125)
+			{
+				logerror("control frame payload greater than 125 bytes - %llu", (unsigned long long)current->payload_len);
+				retval = libwebsock_error(state, WS_CLOSE_PROTOCOL_ERROR);
+				continue;
+			}
+
+			//data frames are passed straight through when streaming, only the header is kept
+			//messages an extension transformed are decoded whole, so they are never streamed
+			frame_fn = libwebsock_frame_lookup_table[libwebsock_frame_index(state, *current->rawdata & 0xff)];
+			if (state->flags & STATE_RECEIVING_FRAGMENT)
+			{
+				transformed = state->message_rsv != 0;
+			}
+			else
+			{
+				transformed = current->rsv != 0;
+			}
+			if (state->onmessage_chunk != NULL && (frame_fn == AA || frame_fn == CC) && !transformed)
+			{
+				current->state = sw_streaming;
+			}
+			else if ((close_code = libwebsock_reserve_rawdata(state, current)) != 0)
 			{
+				if (close_code == WS_CLOSE_UNEXPECTED_ERROR)
+				{
+					retval = libwebsock_fail_no_memory(state);
+				}
+				else
+				{
+					logerror("frame of %llu bytes is too big to buffer", (unsigned long long)current->payload_len);
+					retval = libwebsock_error(state, close_code);
+				}
 				continue;
 			}
 		}
 
+		if (current->state == sw_streaming)
+		{
+			chunk_len = len - i;
+			if (current->size - current->rawdata_idx < chunk_len)
+			{
+				chunk_len = current->size - current->rawdata_idx;
+			}
+
+			if (writable && (chunk_len > 0 || current->payload_len == 0))
+			{
+				retval = libwebsock_dispatch_chunk(state, buf, chunk_len);
+				buf += chunk_len;
+				i += chunk_len;
+				if (retval == -1)
+				{
+					break;
+				}
+			}
+			else if (chunk_len > 0 || current->payload_len == 0)
+			{
+				do
+				{
+					n = chunk_len < sizeof(bounce) ? chunk_len : sizeof(bounce);
+					memcpy(bounce, buf, n);
+					retval = libwebsock_dispatch_chunk(state, bounce, n);
+					buf += n;
+					i += n;
+					chunk_len -= n;
+				} while (chunk_len > 0 && retval != -1 && (state->flags & STATE_PROCESSING_ERROR) == 0);
+				if (retval == -1)
+				{
+					break;
+				}
+			}
+
+			if (state->current_frame != NULL && state->current_frame->state == sw_streaming)
+			{
+				state->flags |= STATE_NEEDS_MORE_DATA;
+			}
+			continue;
+		}
+
 		if (current->rawdata_idx < current->size)
 		{
 			if (len - i >= current->size - current->rawdata_idx)
@@ -476,8 +1244,7 @@ int libwebsock_handle_recv(libwebsock_client_state *state, const char *data, siz
 			}
 		}
 
-		in_fragment = (state->flags & STATE_RECEIVING_FRAGMENT) ? 256 : 0;
-		frame_fn = libwebsock_frame_lookup_table[in_fragment | (*current->rawdata & 0xff)];
+		frame_fn = libwebsock_frame_lookup_table[libwebsock_frame_index(state, *current->rawdata & 0xff)];
 
 		retval = frame_fn(state);
 		if (retval == -1)
@@ -495,6 +1262,84 @@ int libwebsock_handle_recv(libwebsock_client_state *state, const char *data, siz
 	return retval;
 }
 
+/*
+ * Feeds received bytes through the frame parser.  data is left untouched;
+ * every frame is staged in a buffer of its own before it is dispatched.
+ */
+int libwebsock_handle_recv(libwebsock_client_state *state, const char *data, size_t len)
+{
+	int retval = libwebsock_recv(state, (char *)data, len, 0);
+
+	if (state->batch_len > 0)
+	{
+		retval = libwebsock_flush_batch(state);
+	}
+	return retval;
+}
+
+/*
+ * Like libwebsock_handle_recv, but data is unmasked in place: complete
+ * frames are dispatched straight from it and onmessage gets a view into it,
+ * so nothing is copied.  data must be writable and its contents are
+ * changed.
+ */
+int libwebsock_handle_recv_inplace(libwebsock_client_state *state, char *data, size_t len)
+{
+	int retval = libwebsock_recv(state, data, len, 1);
+
+	//batched payloads may point into data, so they go out before returning
+	if (state->batch_len > 0)
+	{
+		retval = libwebsock_flush_batch(state);
+	}
+	return retval;
+}
+
+/*
+ * Feeds each segment through the receive path in turn.  A frame that lies
+ * entirely within one segment is dispatched from it in place; one straddling
+ * segments is picked up by the frame state machine just as if the segments
+ * had arrived in separate reads.  Segments are unmasked in place, so they
+ * must be writable.  Messages for onmessage_batch are collected across all
+ * segments and delivered once.
+ */
+int libwebsock_handle_recv_iov(libwebsock_client_state *state, const struct iovec *iov, int iovcnt)
+{
+	int n, err, retval = -1;
+
+	for (n = 0; n < iovcnt; n++)
+	{
+		if (iov[n].iov_len == 0)
+		{
+			continue;
+		}
+
+		err = libwebsock_recv(state, (char *)iov[n].iov_base, iov[n].iov_len, 1);
+		if (state->flags & STATE_PROCESSING_ERROR)
+		{
+			retval = err;
+			break;
+		}
+
+		//-1 with STATE_NEEDS_MORE_DATA only means the segment ended mid-frame
+		if (err != -1)
+		{
+			retval = err;
+		}
+		else if ((state->flags & STATE_NEEDS_MORE_DATA) == 0)
+		{
+			retval = -1;
+			break;
+		}
+	}
+
+	if (state->batch_len > 0)
+	{
+		retval = libwebsock_flush_batch(state);
+	}
+	return retval;
+}
+
 static const char *get_selected_subprotocol(libwebsock_client_state *state, char *client_requested_subprotocols)
 {
 	char *tok = NULL;
@@ -520,6 +1365,28 @@ static const char *get_selected_subprotocol(libwebsock_client_state *state, char
 	return NULL;
 }
 
+//base64(SHA1(key + GUID)), the Sec-WebSocket-Accept value answering key
+static void libwebsock_accept_key(const char *key, char *out, size_t out_len)
+{
+	const char *GID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	unsigned char sha1mac[20];
+	SHA1Context shactx;
+	int n;
+
+	SHA1Reset(&shactx);
+	SHA1Input(&shactx, (const unsigned char *)key, strlen(key));
+	SHA1Input(&shactx, (const unsigned char *)GID, strlen(GID));
+	SHA1Result(&shactx);
+	for (n = 0; n < 5; n++)
+	{
+		sha1mac[n * 4] = (shactx.Message_Digest[n] >> 24) & 0xff;
+		sha1mac[n * 4 + 1] = (shactx.Message_Digest[n] >> 16) & 0xff;
+		sha1mac[n * 4 + 2] = (shactx.Message_Digest[n] >> 8) & 0xff;
+		sha1mac[n * 4 + 3] = shactx.Message_Digest[n] & 0xff;
+	}
+	base64_encode(sha1mac, 20, out, out_len);
+}
+
 int libwebsock_populate_handshake(libwebsock_client_state *state, const char *data, size_t len)
 {
 	if (strstr(data, "\r\n\r\n") == NULL && strstr(data, "\n\n") == NULL)
@@ -529,26 +1396,30 @@ int libwebsock_populate_handshake(libwebsock_client_state *state, const char *da
 	}
 
 	char buf[2048];
-	char sha1buf[45];
-	char concat[1024];
-	unsigned char sha1mac[20];
+	char accept_key[32];
 	char *tok = NULL, *headers = NULL, *key = NULL;
-	char *base64buf = NULL;
-	const char *GID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-	SHA1Context shactx;
-	SHA1Reset(&shactx);
-	int n = 0;
-	int len_subprotocol = 0;
+	char *out;
+	int len_subprotocol = 0, len_extensions = 0;
 	char client_sub_protocols[MAX_SUB_PROTOCOL_LENGTH] = {'\0'};
+	char client_extensions[MAX_SUB_PROTOCOL_LENGTH] = {'\0'};
+	char extensions_response[MAX_SUB_PROTOCOL_LENGTH];
 
-	headers = (char *)lws_calloc(len + 1);
+	headers = (char *)lws_state_calloc(state, len + 1);
+	if (headers == NULL)
+	{
+		return -1;
+	}
 	strncpy(headers, data, len);
 
 	for (tok = strtok(headers, "\r\n"); tok != NULL; tok = strtok(NULL, "\r\n"))
 	{
-		if (strstr(tok, "Sec-WebSocket-Key: ") != NULL)
+		if (strstr(tok, "Sec-WebSocket-Key: ") != NULL && key == NULL)
 		{
-			key = (char *)lws_malloc(strlen(tok));
+			key = (char *)lws_state_malloc(state, strlen(tok));
+			if (key == NULL)
+			{
+				continue;
+			}
 			strncpy(key, tok + strlen("Sec-WebSocket-Key: "), strlen(tok));
 			continue;
 		}
@@ -573,8 +1444,29 @@ int libwebsock_populate_handshake(libwebsock_client_state *state, const char *da
 			len_subprotocol += token_len - header_len;
 			continue;
 		}
+
+		// Extension offers may also be split over several headers
+		if (strstr(tok, "Sec-WebSocket-Extensions: ") != NULL)
+		{
+			size_t header_len = strlen("Sec-WebSocket-Extensions: ");
+			size_t token_len = strlen(tok);
+
+			if (len_extensions + token_len - header_len > MAX_SUB_PROTOCOL_LENGTH - 1)
+			{
+				continue;
+			}
+
+			if (len_extensions > 0)
+			{
+				client_extensions[len_extensions++] = ',';
+			}
+
+			strncpy(client_extensions + len_extensions, tok + header_len, token_len - header_len);
+			len_extensions += token_len - header_len;
+			continue;
+		}
 	}
-	lws_free(headers);
+	lws_state_free(state, headers);
 
 	if (key == NULL)
 	{
@@ -582,22 +1474,9 @@ int libwebsock_populate_handshake(libwebsock_client_state *state, const char *da
 		return -1;
 	}
 
-	memset(concat, 0, sizeof(concat));
-	strncat(concat, key, strlen(key));
-	strncat(concat, GID, strlen(GID));
-	SHA1Input(&shactx, (unsigned char *)concat, strlen(concat));
-	SHA1Result(&shactx);
-	lws_free(key);
+	libwebsock_accept_key(key, accept_key, sizeof(accept_key));
+	lws_state_free(state, key);
 	key = NULL;
-	sprintf(sha1buf, "%08x%08x%08x%08x%08x", shactx.Message_Digest[0],
-			shactx.Message_Digest[1], shactx.Message_Digest[2],
-			shactx.Message_Digest[3], shactx.Message_Digest[4]);
-	for (n = 0; n < (strlen(sha1buf) / 2); n++)
-	{
-		sscanf(sha1buf + (n * 2), "%02hhx", sha1mac + n);
-	}
-	base64buf = (char *)lws_malloc(256);
-	base64_encode(sha1mac, 20, base64buf, 256);
 	memset(buf, 0, 1024);
 
 	int buflen = snprintf(buf, 1024, "HTTP/1.1 101 Switching Protocols\r\n"
@@ -606,30 +1485,193 @@ int libwebsock_populate_handshake(libwebsock_client_state *state, const char *da
 									 "Connection: Upgrade\r\n"
 									 "Sec-WebSocket-Accept: %s\r\n",
 						  state->hostname,
-						  base64buf);
+						  accept_key);
 
 	const char *selected_protocol = get_selected_subprotocol(state, client_sub_protocols);
 	if (selected_protocol != NULL)
 	{
-		snprintf(buf + buflen, 1024, "Sec-WebSocket-Protocol: %s\r\n\r\n", selected_protocol);
+		buflen += snprintf(buf + buflen, 1024, "Sec-WebSocket-Protocol: %s\r\n", selected_protocol);
 	}
-	else
+
+	if (lws_extension_accept_offers(state, client_extensions, extensions_response, sizeof(extensions_response)) > 0)
+	{
+		buflen += snprintf(buf + buflen, sizeof(buf) - buflen, "Sec-WebSocket-Extensions: %s\r\n", extensions_response);
+	}
+	snprintf(buf + buflen, 1024, "\r\n");
+
+	buflen = strlen(buf);
+	out = lws_output_reserve(state, buflen);
+	if (out == NULL)
 	{
-		snprintf(buf + buflen, 1024, "\r\n");
+		return -1;
 	}
+	memcpy(out, buf, buflen);
+	//corking and congestion describe the output queue, which outlives the handshake
+	state->flags = STATE_CONNECTED | (state->flags & (STATE_DEFLATE | STATE_OUTPUT_CORKED | STATE_OUTPUT_CONGESTED));
+	return 0;
+}
 
-	lws_free(base64buf);
+/*
+ * Starts the client side of the opening handshake: queues the upgrade
+ * request for path on host with a fresh Sec-WebSocket-Key, and switches the
+ * state to the client role so outgoing frames are masked.
+ */
+int libwebsock_make_client_handshake(libwebsock_client_state *state, const char *host, const char *path,
+									 const char *subprotocols)
+{
+	unsigned char nonce[16];
+	char key[32];
+	char buf[2048];
+	char offer[MAX_SUB_PROTOCOL_LENGTH];
+	int buflen;
+	char *out;
+
+	lws_random_bytes(nonce, sizeof(nonce));
+	base64_encode(nonce, sizeof(nonce), key, sizeof(key));
+	libwebsock_accept_key(key, state->accept_key, sizeof(state->accept_key));
+	lws_random_bytes(&state->mask_prng, sizeof(state->mask_prng));
+
+	buflen = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n"
+										"Host: %s\r\n"
+										"Upgrade: websocket\r\n"
+										"Connection: Upgrade\r\n"
+										"Sec-WebSocket-Key: %s\r\n"
+										"Sec-WebSocket-Version: 13\r\n",
+					  path != NULL ? path : "/", host, key);
+	if (subprotocols != NULL && *subprotocols != '\0' && buflen < (int)sizeof(buf))
+	{
+		buflen += snprintf(buf + buflen, sizeof(buf) - buflen, "Sec-WebSocket-Protocol: %s\r\n", subprotocols);
+	}
+	if (lws_extension_make_offers(state, offer, sizeof(offer)) > 0 && buflen < (int)sizeof(buf))
+	{
+		buflen += snprintf(buf + buflen, sizeof(buf) - buflen, "Sec-WebSocket-Extensions: %s\r\n", offer);
+	}
+	if (buflen + 2 >= (int)sizeof(buf))
+	{
+		logerror("handshake request too long");
+		return -1;
+	}
+	buflen += snprintf(buf + buflen, sizeof(buf) - buflen, "\r\n");
 
-	libwebsock_string *str = state->out_data;
-	if (!str)
+	out = lws_output_reserve(state, buflen);
+	if (out == NULL)
 	{
-		state->out_data = (libwebsock_string *)lws_calloc(sizeof(libwebsock_string));
-		str = state->out_data;
-		str->data_sz = strlen(buf);
-		str->data = (char *)lws_calloc(str->data_sz);
+		return -1;
 	}
+	memcpy(out, buf, buflen);
+	state->flags |= STATE_CLIENT | STATE_CONNECTING;
+	return 0;
+}
+
+static int libwebsock_header_has_token(const char *value, const char *token)
+{
+	size_t token_len = strlen(token);
+	const char *p = value;
 
-	memcpy(str->data + str->idx, buf, str->data_sz);
-	state->flags = STATE_CONNECTED;
+	while (*p != '\0')
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',')
+		{
+			p++;
+		}
+		if (strncasecmp(p, token, token_len) == 0 &&
+			(p[token_len] == '\0' || p[token_len] == ',' || p[token_len] == ' ' || p[token_len] == '\t'))
+		{
+			return 1;
+		}
+		while (*p != '\0' && *p != ',')
+		{
+			p++;
+		}
+	}
 	return 0;
 }
+
+/*
+ * Checks the server's answer to libwebsock_make_client_handshake.  Returns
+ * the length of the response headers once they are complete and valid, so
+ * any frames that followed them in data can be passed on to
+ * libwebsock_handle_recv; 0 if the headers are still incomplete; -1 if the
+ * upgrade was refused or the accept key doesn't match.
+ */
+int libwebsock_verify_handshake_response(libwebsock_client_state *state, const char *data, size_t len)
+{
+	char *headers, *tok, *value;
+	size_t header_len;
+	int status = 0, got_upgrade = 0, got_connection = 0, got_accept = 0, bad_extensions = 0;
+
+	for (header_len = 0; header_len + 4 <= len; header_len++)
+	{
+		if (memcmp(data + header_len, "\r\n\r\n", 4) == 0)
+		{
+			break;
+		}
+	}
+	if (header_len + 4 > len)
+	{
+		state->flags |= STATE_NEEDS_MORE_DATA;
+		return 0;
+	}
+	header_len += 4;
+	state->flags &= ~STATE_NEEDS_MORE_DATA;
+
+	headers = (char *)lws_state_calloc(state, header_len + 1);
+	if (headers == NULL)
+	{
+		return -1;
+	}
+	memcpy(headers, data, header_len);
+
+	if (sscanf(headers, "HTTP/1.1 %d", &status) != 1 || status != 101)
+	{
+		logerror("server refused the upgrade with status %d", status);
+		lws_state_free(state, headers);
+		return -1;
+	}
+
+	for (tok = strtok(headers, "\r\n"); tok != NULL; tok = strtok(NULL, "\r\n"))
+	{
+		value = strchr(tok, ':');
+		if (value == NULL)
+		{
+			continue;
+		}
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+		{
+			value++;
+		}
+
+		if (strcasecmp(tok, "Upgrade") == 0)
+		{
+			got_upgrade = strcasecmp(value, "websocket") == 0;
+		}
+		else if (strcasecmp(tok, "Connection") == 0)
+		{
+			got_connection = libwebsock_header_has_token(value, "upgrade");
+		}
+		else if (strcasecmp(tok, "Sec-WebSocket-Accept") == 0)
+		{
+			got_accept = strcmp(value, state->accept_key) == 0;
+		}
+		else if (strcasecmp(tok, "Sec-WebSocket-Extensions") == 0)
+		{
+			//only what we offered may be picked, and only once
+			if (lws_extension_accept_response(state, value) == -1)
+			{
+				bad_extensions = 1;
+			}
+		}
+	}
+	lws_state_free(state, headers);
+
+	if (!got_upgrade || !got_connection || !got_accept || bad_extensions)
+	{
+		logerror("invalid handshake response");
+		return -1;
+	}
+
+	state->flags &= ~STATE_CONNECTING;
+	state->flags |= STATE_CONNECTED;
+	return header_len;
+}
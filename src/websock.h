@@ -47,6 +47,9 @@
 #endif
 
 #include <assert.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <wchar.h>
 #include <errno.h>
@@ -59,13 +62,25 @@
 #include "default_callbacks.h"
 #include "utf.h"
 #include "util.h"
+#include "mask.h"
+#include "output.h"
+#include "deflate.h"
+#include "extension.h"
 
 #define PORT_STRLEN 12
 #define LISTEN_BACKLOG 10
 #define FRAME_CHUNK_LENGTH 1024
+#define FRAME_POOL_SIZE 4
+#define FRAME_POOL_MAX_RAWDATA (16 * FRAME_CHUNK_LENGTH)
+#define OUTPUT_SEGMENT_SIZE (4 * FRAME_CHUNK_LENGTH)
+#define OUTPUT_HIGH_BURST 8
+#define OUTPUT_LANE_FRAGMENT_SIZE (16 * FRAME_CHUNK_LENGTH)
 #define MASK_LENGTH 4
 
 #define WS_FRAGMENT_FIN (1 << 7)
+#define WS_FRAGMENT_RSV1 (1 << 6)
+#define WS_FRAGMENT_RSV2 (1 << 5)
+#define WS_FRAGMENT_RSV3 (1 << 4)
 
 #define WS_NONBLOCK 0x02
 
@@ -97,12 +112,31 @@
 #define STATE_NEEDS_MORE_DATA (1 << 6)
 #define STATE_SHOULD_CLOSE (1 << 7)
 #define STATE_CONTINUOUS_FRAME_IN_PROGRESS (1 << 8)
+#define STATE_OUTPUT_CONGESTED (1 << 9)
+#define STATE_CLIENT (1 << 10)
+#define STATE_OUTPUT_CORKED (1 << 11)
+#define STATE_DEFLATE (1 << 12)
+
+//frames from the peer carry a mask exactly when we are the server
+#define LWS_EXPECT_MASKED(state) (((state)->flags & STATE_CLIENT) == 0)
 
 void libwebsock_cleanup_outdata(libwebsock_client_state *state);
-void libwebsock_populate_close_info_from_frame(libwebsock_close_info **info, libwebsock_frame *close_frame);
+void libwebsock_populate_close_info_from_frame(libwebsock_client_state *state, libwebsock_close_info **info, libwebsock_frame *close_frame);
 int libwebsock_error(libwebsock_client_state *state, unsigned short error_code);
 int libwebsock_handle_control_frame(libwebsock_client_state *state);
 int libwebsock_dispatch_message(libwebsock_client_state *state);
+int libwebsock_flush_batch(libwebsock_client_state *state);
 int libwebsock_handle_recv(libwebsock_client_state *state, const char *data, size_t len);
+int libwebsock_handle_recv_inplace(libwebsock_client_state *state, char *data, size_t len);
+int libwebsock_handle_recv_iov(libwebsock_client_state *state, const struct iovec *iov, int iovcnt);
 int libwebsock_populate_handshake(libwebsock_client_state *state, const char *data, size_t len);
-int libwebsock_make_fragment(libwebsock_client_state *state, const char *data, unsigned int len, int flags);
+int libwebsock_make_client_handshake(libwebsock_client_state *state, const char *host, const char *path, const char *subprotocols);
+int libwebsock_verify_handshake_response(libwebsock_client_state *state, const char *data, size_t len);
+ssize_t libwebsock_make_fragment(libwebsock_client_state *state, const char *data, size_t len, int flags);
+char *libwebsock_reserve(libwebsock_client_state *state, size_t max_len);
+ssize_t libwebsock_commit(libwebsock_client_state *state, size_t len, int opcode);
+ssize_t libwebsock_make_fragment_zerocopy(libwebsock_client_state *state, const char *data, size_t len, int flags, libwebsock_release_fn release, void *release_arg);
+libwebsock_shared_frame *libwebsock_make_shared_frame(const char *data, size_t len, int flags);
+void libwebsock_release_shared_frame(libwebsock_shared_frame *frame);
+ssize_t libwebsock_queue_shared_frame(libwebsock_client_state *state, libwebsock_shared_frame *frame);
+size_t libwebsock_broadcast(libwebsock_client_state **states, size_t count, const char *data, size_t len, int flags);
@@ -0,0 +1,162 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * onmessage_batch gets every message completed by one receive call in a
+ * single call, in wire order, with control frames and errors splitting the
+ * batch so callbacks still see events in the order they arrived.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+#define MAX_BATCHES 8
+#define MAX_MESSAGES 8
+
+static struct
+{
+  int batches;
+  size_t sizes[MAX_BATCHES];
+  int messages;
+  unsigned int opcode[MAX_MESSAGES];
+  size_t len[MAX_MESSAGES];
+  char data[MAX_MESSAGES][64];
+  int errors_seen_first;
+} seen;
+
+static int record_batch(libwebsock_client_state *state, libwebsock_message *msgs, size_t n)
+{
+  size_t i;
+
+  (void)state;
+  if (seen.batches < MAX_BATCHES)
+  {
+    seen.sizes[seen.batches] = n;
+  }
+  seen.batches++;
+  seen.errors_seen_first += received.errors > 0;
+  for (i = 0; i < n && seen.messages < MAX_MESSAGES; i++, seen.messages++)
+  {
+    seen.opcode[seen.messages] = msgs[i].opcode;
+    seen.len[seen.messages] = msgs[i].payload_len;
+    memcpy(seen.data[seen.messages], msgs[i].payload,
+           msgs[i].payload_len < sizeof(seen.data[0]) ? msgs[i].payload_len : sizeof(seen.data[0]));
+  }
+  return 0;
+}
+
+static libwebsock_client_state *make_server(void)
+{
+  libwebsock_client_state *server = test_state();
+
+  test_reset();
+  memset(&seen, 0, sizeof(seen));
+  test_accept(server, NULL);
+  server->onmessage_batch = record_batch;
+  return server;
+}
+
+static int seen_message(int n, unsigned int opcode, const char *data)
+{
+  return seen.opcode[n] == opcode && seen.len[n] == strlen(data) && memcmp(seen.data[n], data, seen.len[n]) == 0;
+}
+
+//a whole frame, a fragmented message and a staged frame in one read
+static void test_one_read(void)
+{
+  libwebsock_client_state *server = make_server();
+  char wire[256];
+  size_t len;
+  int inplace;
+
+  for (inplace = 0; inplace < 2; inplace++)
+  {
+    len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "one", 3);
+    len += test_client_frame(wire + len, WS_OPCODE_BINARY, "tw", 2);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, "o", 1);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "three", 5);
+    if (inplace)
+    {
+      libwebsock_handle_recv_inplace(server, wire, len);
+    }
+    else
+    {
+      libwebsock_handle_recv(server, wire, len);
+    }
+  }
+  CHECK(received.errors == 0 && received.messages == 0);
+  CHECK(seen.batches == 2 && seen.sizes[0] == 3 && seen.sizes[1] == 3);
+  CHECK(seen_message(0, WS_OPCODE_TEXT, "one") && seen_message(1, WS_OPCODE_BINARY, "two") &&
+        seen_message(2, WS_OPCODE_TEXT, "three"));
+  CHECK(seen_message(3, WS_OPCODE_TEXT, "one") && seen_message(4, WS_OPCODE_BINARY, "two") &&
+        seen_message(5, WS_OPCODE_TEXT, "three"));
+  libwebsock_client_destroy(server);
+}
+
+//a message cut off at the end of a read joins the batch of the read completing it
+static void test_split_message(void)
+{
+  libwebsock_client_state *server = make_server();
+  char wire[256];
+  size_t len, first;
+
+  first = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "one", 3);
+  len = first + test_client_frame(wire + first, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "two", 3);
+  libwebsock_handle_recv_inplace(server, wire, first + 4);
+  CHECK(seen.batches == 1 && seen.sizes[0] == 1);
+  libwebsock_handle_recv_inplace(server, wire + first + 4, len - first - 4);
+  CHECK(seen.batches == 2 && seen.sizes[1] == 1);
+  CHECK(seen_message(0, WS_OPCODE_TEXT, "one") && seen_message(1, WS_OPCODE_TEXT, "two"));
+  libwebsock_client_destroy(server);
+}
+
+//what came before a ping or a protocol error is delivered before it
+static void test_ordering(void)
+{
+  libwebsock_client_state *server = make_server();
+  char wire[256], out[64];
+  size_t len;
+
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "one", 3);
+  len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_PING, "pp", 2);
+  len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "two", 3);
+  libwebsock_handle_recv_inplace(server, wire, len);
+  CHECK(seen.batches == 2 && seen.sizes[0] == 1 && seen.sizes[1] == 1);
+  CHECK(seen_message(0, WS_OPCODE_TEXT, "one") && seen_message(1, WS_OPCODE_TEXT, "two"));
+  len = test_drain(server, out, sizeof(out));
+  CHECK(len == 4 && memcmp(out, "\x8a\x02pp", 4) == 0);
+  libwebsock_client_destroy(server);
+
+  server = make_server();
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "one", 3);
+  len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, "two", 3);
+  libwebsock_handle_recv_inplace(server, wire, len);
+  CHECK(seen.batches == 1 && seen.errors_seen_first == 0 && seen_message(0, WS_OPCODE_TEXT, "one"));
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_PROTOCOL_ERROR);
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  test_one_read();
+  test_split_message();
+  test_ordering();
+  return test_done("batch");
+}
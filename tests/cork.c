@@ -0,0 +1,106 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * Corking: frames queued while corked, an automatic pong included, are
+ * held back and handed out together once uncorked, and the count
+ * libwebsock_uncork returns is what libwebsock_pending_iov then covers.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static char bulk[40 * 1024];
+
+//copies out everything pending_iov hands out in one call
+static size_t gather(libwebsock_client_state *state, char *out, size_t *nbytes)
+{
+  struct iovec iov[16];
+  size_t len = 0;
+  int n, iovcnt = libwebsock_pending_iov(state, iov, 16, nbytes);
+
+  for (n = 0; n < iovcnt; n++)
+  {
+    memcpy(out + len, iov[n].iov_base, iov[n].iov_len);
+    len += iov[n].iov_len;
+  }
+  return len;
+}
+
+static void test_cork(void)
+{
+  libwebsock_client_state *server = test_state();
+  const char expected[] = "\x81\x03one\x8a\x02pp\x81\x03two";
+  char ping[16], out[64];
+  size_t len, nbytes;
+
+  test_reset();
+  test_accept(server, NULL);
+  libwebsock_cork(server);
+  CHECK(libwebsock_make_text_data_frame(server, "one") != -1);
+  len = test_client_frame(ping, WS_FRAGMENT_FIN | WS_OPCODE_PING, "pp", 2);
+  libwebsock_handle_recv_inplace(server, ping, len);
+  CHECK(libwebsock_make_text_data_frame(server, "two") != -1);
+
+  CHECK(gather(server, out, &nbytes) == 0 && nbytes == 0);
+  CHECK(libwebsock_output_pending(server) == sizeof(expected) - 1);
+
+  CHECK(libwebsock_uncork(server) == sizeof(expected) - 1);
+  len = gather(server, out, &nbytes);
+  CHECK(len == sizeof(expected) - 1 && nbytes == len && memcmp(out, expected, len) == 0);
+  libwebsock_output_consume(server, nbytes);
+  CHECK(libwebsock_output_pending(server) == 0);
+  libwebsock_client_destroy(server);
+}
+
+//lane data still waiting to be split is pending but not yet in the count
+static void test_uncork_lanes(void)
+{
+  libwebsock_client_state *server = test_state();
+  static char out[64 * 1024];
+  size_t ready, nbytes, len, total = 0;
+
+  test_accept(server, NULL);
+  CHECK(libwebsock_set_send_priority(server, WS_PRIORITY_BULK) == 0);
+  libwebsock_cork(server);
+  CHECK(libwebsock_make_binary_data_frame(server, bulk, sizeof(bulk)) != -1);
+  ready = libwebsock_uncork(server);
+  CHECK(ready > 0 && ready < libwebsock_output_pending(server));
+
+  len = gather(server, out, &nbytes);
+  CHECK(nbytes == ready && len == ready);
+  while (nbytes > 0)
+  {
+    libwebsock_output_consume(server, nbytes);
+    total += nbytes;
+    gather(server, out, &nbytes);
+  }
+  CHECK(libwebsock_output_pending(server) == 0);
+  CHECK(total > sizeof(bulk));
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  memset(bulk, 'b', sizeof(bulk));
+  test_cork();
+  test_uncork_lanes();
+  return test_done("cork");
+}
@@ -0,0 +1,243 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Messages sent from a client to a server and back with
+ * permessage-deflate, with and without a memory_limit and a pool.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static char message[64 * 1024];
+static char wire[256 * 1024];
+
+static void fill_message(size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    message[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+  }
+}
+
+//sends len bytes of message from one side to the other, checks it arrives whole
+static void send_message(libwebsock_client_state *from, libwebsock_client_state *to, size_t len, int rsv)
+{
+  size_t wire_len;
+
+  test_reset();
+  CHECK(libwebsock_make_text_data_frame_with_length(from, message, len) != -1);
+  wire_len = test_drain(from, wire, sizeof(wire));
+  CHECK(wire_len > 0 && (wire[0] & (WS_FRAGMENT_RSV1 | WS_FRAGMENT_RSV2)) == rsv);
+  if (rsv & WS_FRAGMENT_RSV1)
+  {
+    CHECK(wire_len < len);
+  }
+  libwebsock_handle_recv_inplace(to, wire, wire_len);
+  CHECK(received.errors == 0);
+  CHECK(received.messages == 1 && received.opcode == WS_OPCODE_TEXT && received.payload_len == len &&
+        memcmp(received.payload, message, len) == 0);
+}
+
+static void test_deflate(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+
+  CHECK(libwebsock_enable_deflate(client, NULL) == 0);
+  CHECK(libwebsock_enable_deflate(server, NULL) == 0);
+  test_connect(client, server);
+  CHECK(client->flags & STATE_DEFLATE);
+  CHECK(server->flags & STATE_DEFLATE);
+
+  fill_message(sizeof(message));
+  send_message(client, server, 1000, WS_FRAGMENT_RSV1);
+  send_message(server, client, 1000, WS_FRAGMENT_RSV1);
+  //context takeover carries the window into the next message
+  send_message(client, server, 1000, WS_FRAGMENT_RSV1);
+  send_message(client, server, sizeof(message), WS_FRAGMENT_RSV1);
+  send_message(server, client, sizeof(message), WS_FRAGMENT_RSV1);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+//a limit well under the default settings still gets deflate, within the limit
+static void test_memory_limit(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+  libwebsock_deflate_options options;
+
+  memset(&options, 0, sizeof(options));
+  options.memory_limit = 40 * 1024;
+  CHECK(libwebsock_enable_deflate(client, &options) == 0);
+  CHECK(libwebsock_enable_deflate(server, &options) == 0);
+  test_connect(client, server);
+  CHECK(client->flags & STATE_DEFLATE);
+  CHECK(server->flags & STATE_DEFLATE);
+
+  fill_message(sizeof(message));
+  send_message(client, server, sizeof(message), WS_FRAGMENT_RSV1);
+  send_message(server, client, sizeof(message), WS_FRAGMENT_RSV1);
+  CHECK(libwebsock_deflate_memory(client) <= options.memory_limit);
+  CHECK(libwebsock_deflate_memory(server) <= options.memory_limit);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+//a reserved frame goes out uncompressed, which the peer takes as is
+static void test_reserve(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+  size_t wire_len;
+  char *space;
+
+  CHECK(libwebsock_enable_deflate(client, NULL) == 0);
+  CHECK(libwebsock_enable_deflate(server, NULL) == 0);
+  test_connect(client, server);
+
+  fill_message(1000);
+  test_reset();
+  space = libwebsock_reserve(server, 1000);
+  CHECK(space != NULL);
+  memcpy(space, message, 1000);
+  CHECK(libwebsock_commit(server, 1000, WS_OPCODE_TEXT) != -1);
+  wire_len = test_drain(server, wire, sizeof(wire));
+  CHECK(wire_len == 1004 && (wire[0] & WS_FRAGMENT_RSV1) == 0);
+  libwebsock_handle_recv_inplace(client, wire, wire_len);
+  CHECK(received.errors == 0);
+  CHECK(received.messages == 1 && received.payload_len == 1000 && memcmp(received.payload, message, 1000) == 0);
+
+  //and the compressed ones around it are unaffected
+  send_message(server, client, 1000, WS_FRAGMENT_RSV1);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+//pooled streams are charged to the connection only while it has them
+static void test_pool(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+  libwebsock_deflate_pool *pool = libwebsock_deflate_pool_new(NULL);
+  libwebsock_deflate_options options;
+
+  memset(&options, 0, sizeof(options));
+  options.memory_limit = 40 * 1024;
+  options.pool = pool;
+  CHECK(libwebsock_enable_deflate(client, NULL) == 0);
+  CHECK(libwebsock_enable_deflate(server, &options) == 0);
+  test_connect(client, server);
+
+  fill_message(8192);
+  send_message(client, server, 8192, WS_FRAGMENT_RSV1);
+  send_message(server, client, 8192, WS_FRAGMENT_RSV1);
+  CHECK(libwebsock_deflate_memory(server) == 0);
+  CHECK(libwebsock_deflate_pool_memory(pool) > 0);
+  CHECK(libwebsock_deflate_pool_memory(pool) <= 2 * options.memory_limit);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+  libwebsock_deflate_pool_free(pool);
+}
+
+//the streams are shared, so more connections don't take more memory
+static void test_pool_shared(void)
+{
+  libwebsock_client_state *clients[4], *servers[4];
+  libwebsock_deflate_pool *pool = libwebsock_deflate_pool_new(NULL);
+  libwebsock_deflate_options options;
+  size_t after_one = 0;
+  int n;
+
+  memset(&options, 0, sizeof(options));
+  options.pool = pool;
+  fill_message(8192);
+  for (n = 0; n < 4; n++)
+  {
+    clients[n] = test_state();
+    servers[n] = test_state();
+    CHECK(libwebsock_enable_deflate(clients[n], NULL) == 0);
+    CHECK(libwebsock_enable_deflate(servers[n], &options) == 0);
+    test_connect(clients[n], servers[n]);
+    send_message(clients[n], servers[n], 8192, WS_FRAGMENT_RSV1);
+    send_message(servers[n], clients[n], 8192, WS_FRAGMENT_RSV1);
+    CHECK(libwebsock_deflate_memory(servers[n]) == 0);
+    if (n == 0)
+    {
+      after_one = libwebsock_deflate_pool_memory(pool);
+    }
+  }
+  CHECK(after_one > 0 && libwebsock_deflate_pool_memory(pool) == after_one);
+  for (n = 0; n < 4; n++)
+  {
+    libwebsock_client_destroy(clients[n]);
+    libwebsock_client_destroy(servers[n]);
+  }
+  libwebsock_deflate_pool_free(pool);
+}
+
+//a dictionary both ends share makes short messages smaller
+static size_t short_message_size(const char *dictionary)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+  libwebsock_deflate_pool_options pool_options;
+  libwebsock_deflate_pool *client_pool, *server_pool;
+  libwebsock_deflate_options options;
+  size_t wire_len;
+
+  memset(&pool_options, 0, sizeof(pool_options));
+  pool_options.dictionary = dictionary;
+  pool_options.dictionary_len = dictionary != NULL ? strlen(dictionary) : 0;
+  client_pool = libwebsock_deflate_pool_new(&pool_options);
+  server_pool = libwebsock_deflate_pool_new(&pool_options);
+  memset(&options, 0, sizeof(options));
+  options.pool = client_pool;
+  CHECK(libwebsock_enable_deflate(client, &options) == 0);
+  options.pool = server_pool;
+  CHECK(libwebsock_enable_deflate(server, &options) == 0);
+  test_connect(client, server);
+
+  test_reset();
+  CHECK(libwebsock_make_text_data_frame(client, "the quick brown fox jumps over the lazy dog") != -1);
+  wire_len = test_drain(client, wire, sizeof(wire));
+  libwebsock_handle_recv_inplace(server, wire, wire_len);
+  CHECK(received.errors == 0 && received.messages == 1 &&
+        strcmp(received.payload, "the quick brown fox jumps over the lazy dog") == 0);
+
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+  libwebsock_deflate_pool_free(client_pool);
+  libwebsock_deflate_pool_free(server_pool);
+  return wire_len;
+}
+
+static void test_pool_dictionary(void)
+{
+  CHECK(short_message_size("the quick brown fox jumps over the lazy dog") < short_message_size(NULL));
+}
+
+int main(void)
+{
+  test_deflate();
+  test_memory_limit();
+  test_reserve();
+  test_pool();
+  test_pool_shared();
+  test_pool_dictionary();
+  return test_done("deflate-roundtrip");
+}
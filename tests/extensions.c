@@ -0,0 +1,211 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * The extension registry: an extension of our own on RSV2, alone and
+ * stacked on permessage-deflate, frames routed to the extensions by their
+ * RSV bits and bits nobody negotiated refused.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static char message[8192];
+static char wire[64 * 1024];
+static int xor_decodes;
+
+//flips a bit in every byte, so a message only survives if it is decoded
+static char xor_buf[8192 + 1];
+
+//messages starting with '!' are left alone
+static int xor_encode(libwebsock_client_state *state, void *arg, unsigned int opcode, const char *in, size_t in_len,
+                      const char **out, size_t *out_len)
+{
+  size_t i;
+
+  (void)state;
+  (void)arg;
+  (void)opcode;
+  if (in_len > sizeof(xor_buf) - 1)
+  {
+    return -1;
+  }
+  if (in_len > 0 && in[0] == '!')
+  {
+    return 0;
+  }
+  for (i = 0; i < in_len; i++)
+  {
+    xor_buf[i] = in[i] ^ 0x20;
+  }
+  *out = xor_buf;
+  *out_len = in_len;
+  return WS_FRAGMENT_RSV2;
+}
+
+static unsigned short xor_decode(libwebsock_client_state *state, void *arg, unsigned int opcode, unsigned int rsv,
+                                 char *in, size_t in_len, char **out, size_t *out_len)
+{
+  size_t i;
+
+  (void)state;
+  (void)arg;
+  (void)opcode;
+  (void)rsv;
+  xor_decodes++;
+  for (i = 0; i < in_len; i++)
+  {
+    in[i] ^= 0x20;
+  }
+  *out = in;
+  *out_len = in_len;
+  return 0;
+}
+
+static const libwebsock_extension xor_extension = {"x-test-xor", WS_FRAGMENT_RSV2, NULL, NULL, NULL,
+                                                   xor_encode, xor_decode, NULL};
+
+//sends len bytes of message from one side to the other, checks the RSV bits and that it arrives whole
+static void send_message(libwebsock_client_state *from, libwebsock_client_state *to, size_t len, int rsv)
+{
+  size_t wire_len;
+
+  test_reset();
+  CHECK(libwebsock_make_text_data_frame_with_length(from, message, len) != -1);
+  wire_len = test_drain(from, wire, sizeof(wire));
+  CHECK(wire_len > 0 && (wire[0] & (WS_FRAGMENT_RSV1 | WS_FRAGMENT_RSV2 | WS_FRAGMENT_RSV3)) == rsv);
+  libwebsock_handle_recv_inplace(to, wire, wire_len);
+  CHECK(received.errors == 0);
+  CHECK(received.messages == 1 && received.opcode == WS_OPCODE_TEXT && received.payload_len == len &&
+        memcmp(received.payload, message, len) == 0);
+}
+
+static void connect_with(libwebsock_client_state *client, libwebsock_client_state *server, int deflate, int xor)
+{
+  if (deflate)
+  {
+    CHECK(libwebsock_enable_deflate(client, NULL) == 0);
+    CHECK(libwebsock_enable_deflate(server, NULL) == 0);
+  }
+  if (xor)
+  {
+    CHECK(libwebsock_add_extension(client, &xor_extension, NULL) == 0);
+    CHECK(libwebsock_add_extension(server, &xor_extension, NULL) == 0);
+  }
+  test_connect(client, server);
+}
+
+static void test_alone(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+
+  connect_with(client, server, 0, 1);
+  send_message(client, server, 4096, WS_FRAGMENT_RSV2);
+  send_message(server, client, 4096, WS_FRAGMENT_RSV2);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+static void test_stacked(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+
+  connect_with(client, server, 1, 1);
+  send_message(client, server, 4096, WS_FRAGMENT_RSV1 | WS_FRAGMENT_RSV2);
+  send_message(server, client, 4096, WS_FRAGMENT_RSV1 | WS_FRAGMENT_RSV2);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+//a message with only deflate's bit set never reaches the other extension
+static void test_routing(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+  int decodes;
+
+  connect_with(client, server, 1, 1);
+  message[0] = '!';
+  decodes = xor_decodes;
+  send_message(client, server, 4096, WS_FRAGMENT_RSV1);
+  CHECK(xor_decodes == decodes);
+  message[0] = 't';
+  send_message(client, server, 4096, WS_FRAGMENT_RSV1 | WS_FRAGMENT_RSV2);
+  CHECK(xor_decodes == decodes + 1);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+//RSV bits no extension in use claims fail the connection
+static void test_unclaimed_bits(void)
+{
+  static const int bits[] = {WS_FRAGMENT_RSV1, WS_FRAGMENT_RSV2, WS_FRAGMENT_RSV3};
+  libwebsock_client_state *server;
+  char frame[64];
+  size_t len, i;
+
+  for (i = 0; i < sizeof(bits) / sizeof(bits[0]); i++)
+  {
+    server = test_state();
+    test_reset();
+    test_accept(server, NULL);
+    len = test_client_frame(frame, WS_FRAGMENT_FIN | WS_OPCODE_TEXT | bits[i], "hi", 2);
+    libwebsock_handle_recv_inplace(server, frame, len);
+    CHECK(received.messages == 0);
+    CHECK(received.errors == 1 && received.close_code == WS_CLOSE_PROTOCOL_ERROR);
+    libwebsock_client_destroy(server);
+  }
+
+  server = test_state();
+  test_reset();
+  CHECK(libwebsock_add_extension(server, &xor_extension, NULL) == 0);
+  test_accept(server, "x-test-xor");
+  len = test_client_frame(frame, WS_FRAGMENT_FIN | WS_OPCODE_TEXT | WS_FRAGMENT_RSV3, "hi", 2);
+  libwebsock_handle_recv_inplace(server, frame, len);
+  CHECK(received.messages == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_PROTOCOL_ERROR);
+  libwebsock_client_destroy(server);
+}
+
+//a reserved frame would skip the encoding, so it can't be had
+static void test_reserve(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+
+  connect_with(client, server, 1, 1);
+  CHECK(libwebsock_reserve(server, 100) == NULL);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(message); i++)
+  {
+    message[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+  }
+  test_alone();
+  test_stacked();
+  test_routing();
+  test_unclaimed_bits();
+  test_reserve();
+  return test_done("extensions");
+}
@@ -0,0 +1,156 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * Fragmented messages are reassembled into one buffer and delivered once,
+ * with control frames between the fragments handled as they come.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static char payload[26000];
+static char wire[32 * 1024];
+static char copy[32 * 1024];
+
+//feeds wire whole through the in-place call, or a byte at a time through the other
+static void feed(libwebsock_client_state *server, size_t len, int bytewise)
+{
+  size_t i;
+
+  memcpy(copy, wire, len);
+  if (bytewise)
+  {
+    for (i = 0; i < len && received.errors == 0; i++)
+    {
+      libwebsock_handle_recv(server, copy + i, 1);
+    }
+  }
+  else
+  {
+    libwebsock_handle_recv_inplace(server, copy, len);
+  }
+}
+
+static libwebsock_client_state *make_server(void)
+{
+  libwebsock_client_state *server = test_state();
+
+  test_reset();
+  test_accept(server, NULL);
+  return server;
+}
+
+static void test_reassembly(void)
+{
+  libwebsock_client_state *server;
+  char out[64];
+  size_t len;
+  int bytewise;
+
+  for (bytewise = 0; bytewise < 2; bytewise++)
+  {
+    server = make_server();
+    len = test_client_frame(wire, WS_OPCODE_BINARY, payload, 1000);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_PING, "pp", 2);
+    len += test_client_frame(wire + len, WS_OPCODE_CONTINUE, payload + 1000, 0);
+    len += test_client_frame(wire + len, WS_OPCODE_CONTINUE, payload + 1000, 5000);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, payload + 6000, 20000);
+    feed(server, len, bytewise);
+    CHECK(received.errors == 0);
+    CHECK(received.messages == 1 && received.opcode == WS_OPCODE_BINARY);
+    CHECK(received.payload_len == sizeof(payload) && memcmp(received.payload, payload, sizeof(payload)) == 0);
+    len = test_drain(server, out, sizeof(out));
+    CHECK(len == 4 && memcmp(out, "\x8a\x02pp", 4) == 0);
+
+    //the next message starts from an empty buffer
+    test_reset();
+    len = test_client_frame(wire, WS_OPCODE_TEXT, "ab", 2);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, "cd", 2);
+    feed(server, len, bytewise);
+    CHECK(received.messages == 1 && received.opcode == WS_OPCODE_TEXT && received.payload_len == 4 &&
+          memcmp(received.payload, "abcd", 4) == 0);
+    libwebsock_client_destroy(server);
+  }
+}
+
+//a character may be cut between fragments, but the message as a whole must be valid
+static void test_text(void)
+{
+  libwebsock_client_state *server;
+  size_t len;
+  int bytewise;
+
+  for (bytewise = 0; bytewise < 2; bytewise++)
+  {
+    server = make_server();
+    len = test_client_frame(wire, WS_OPCODE_TEXT, "caf\xc3", 4);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, "\xa9", 1);
+    feed(server, len, bytewise);
+    CHECK(received.errors == 0);
+    CHECK(received.messages == 1 && received.payload_len == 5 && memcmp(received.payload, "caf\xc3\xa9", 5) == 0);
+    libwebsock_client_destroy(server);
+
+    server = make_server();
+    len = test_client_frame(wire, WS_OPCODE_TEXT, "caf\xc3", 4);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, "e", 1);
+    feed(server, len, bytewise);
+    CHECK(received.messages == 0);
+    CHECK(received.errors == 1 && received.close_code == WS_CLOSE_WRONG_TYPE);
+    libwebsock_client_destroy(server);
+  }
+}
+
+static void test_bad_sequences(void)
+{
+  libwebsock_client_state *server;
+  size_t len;
+
+  //a continuation with nothing to continue
+  server = make_server();
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, "ab", 2);
+  feed(server, len, 0);
+  CHECK(received.messages == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_PROTOCOL_ERROR);
+  libwebsock_client_destroy(server);
+
+  //a new message before the last one is finished
+  server = make_server();
+  len = test_client_frame(wire, WS_OPCODE_BINARY, "ab", 2);
+  len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_BINARY, "cd", 2);
+  feed(server, len, 0);
+  CHECK(received.messages == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_PROTOCOL_ERROR);
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(payload); i++)
+  {
+    payload[i] = (char)(i * 13);
+  }
+  test_reassembly();
+  test_text();
+  test_bad_sequences();
+  return test_done("fragments");
+}
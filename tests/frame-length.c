@@ -0,0 +1,135 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Payload length edge cases, fed both as one buffer, which takes the
+ * in-place path, and a byte at a time, which takes the staged one.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static void recv_frame(const char *frame, size_t len, int bytewise)
+{
+  libwebsock_client_state *server = test_state();
+  char copy[1024];
+  size_t i;
+
+  test_reset();
+  test_accept(server, NULL);
+  memcpy(copy, frame, len);
+  if (bytewise)
+  {
+    for (i = 0; i < len && received.errors == 0; i++)
+    {
+      libwebsock_handle_recv(server, copy + i, 1);
+    }
+  }
+  else
+  {
+    libwebsock_handle_recv_inplace(server, copy, len);
+  }
+  libwebsock_client_destroy(server);
+}
+
+//a 64-bit length with the top bit set is a protocol error, whatever follows
+static void test_msb_length(void)
+{
+  char frame[64] = {(char)0x82, (char)0xff, (char)0xff, (char)0xff, (char)0xff, (char)0xff,
+                    (char)0xff, (char)0xff, (char)0xff, (char)0xf8, 0, 0, 0, 0, 'a', 'b'};
+  int bytewise;
+
+  for (bytewise = 0; bytewise < 2; bytewise++)
+  {
+    recv_frame(frame, 16, bytewise);
+    CHECK(received.messages == 0);
+    CHECK(received.errors == 1);
+    CHECK(received.close_code == WS_CLOSE_PROTOCOL_ERROR);
+  }
+}
+
+//the largest valid 64-bit length is too big to take, not malformed
+static void test_max_length(void)
+{
+  char frame[64] = {(char)0x82, (char)0xff, 0x7f, (char)0xff, (char)0xff, (char)0xff,
+                    (char)0xff, (char)0xff, (char)0xff, (char)0xff, 0, 0, 0, 0, 'a', 'b'};
+  int bytewise;
+
+  for (bytewise = 0; bytewise < 2; bytewise++)
+  {
+    recv_frame(frame, 16, bytewise);
+    CHECK(received.messages == 0);
+    CHECK(received.errors == 1);
+    CHECK(received.close_code == WS_CLOSE_MESSAGE_TOO_BIG);
+  }
+}
+
+//a short payload in the 16 and 64-bit forms is still delivered
+static void test_long_forms(void)
+{
+  char frame[64] = {(char)0x82, (char)0xfe, 0, 5, 0, 0, 0, 0, 'h', 'e', 'l', 'l', 'o'};
+  char frame64[64] = {(char)0x82, (char)0xff, 0, 0, 0, 0, 0, 0, 0, 5, 0, 0, 0, 0, 'h', 'e', 'l', 'l', 'o'};
+  int bytewise;
+
+  for (bytewise = 0; bytewise < 2; bytewise++)
+  {
+    recv_frame(frame, 13, bytewise);
+    CHECK(received.errors == 0);
+    CHECK(received.messages == 1 && received.payload_len == 5 && memcmp(received.payload, "hello", 5) == 0);
+
+    recv_frame(frame64, 19, bytewise);
+    CHECK(received.errors == 0);
+    CHECK(received.messages == 1 && received.payload_len == 5 && memcmp(received.payload, "hello", 5) == 0);
+  }
+}
+
+//a frame longer than the buffer it starts in waits for the rest
+static void test_split_frame(void)
+{
+  libwebsock_client_state *server;
+  char payload[300], frame[512];
+  size_t len, split;
+
+  memset(payload, 'x', sizeof(payload));
+  len = test_client_frame(frame, WS_FRAGMENT_FIN | WS_OPCODE_BINARY, payload, sizeof(payload));
+  for (split = 1; split < len; split += 37)
+  {
+    test_reset();
+    server = test_state();
+    test_accept(server, NULL);
+    libwebsock_handle_recv_inplace(server, frame, split);
+    CHECK(received.messages == 0);
+    libwebsock_handle_recv_inplace(server, frame + split, len - split);
+    CHECK(received.errors == 0);
+    CHECK(received.messages == 1 && received.payload_len == sizeof(payload) &&
+          memcmp(received.payload, payload, sizeof(payload)) == 0);
+    libwebsock_client_destroy(server);
+    //the frame was unmasked in place
+    test_client_frame(frame, WS_FRAGMENT_FIN | WS_OPCODE_BINARY, payload, sizeof(payload));
+  }
+}
+
+int main(void)
+{
+  test_msb_length();
+  test_max_length();
+  test_long_forms();
+  test_split_frame();
+  return test_done("frame-length");
+}
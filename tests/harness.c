@@ -0,0 +1,189 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Shared by the tests: states with recording callbacks, a server handshake
+ * from a canned request, a client and server connected to each other, and
+ * masked client frames built by hand.  Everything runs in memory, no
+ * sockets involved.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+test_record received;
+int test_failures;
+
+static int test_onmessage(libwebsock_client_state *state, libwebsock_message *msg)
+{
+  (void)state;
+  received.messages++;
+  received.opcode = msg->opcode;
+  received.payload_len = msg->payload_len;
+  received.payload_at = msg->payload;
+  if (msg->payload_len < sizeof(received.payload))
+  {
+    memcpy(received.payload, msg->payload, msg->payload_len);
+  }
+  return 0;
+}
+
+static int test_onerror(libwebsock_client_state *state, unsigned short code)
+{
+  (void)state;
+  received.errors++;
+  received.close_code = code;
+  return 0;
+}
+
+libwebsock_client_state *test_state(void)
+{
+  libwebsock_client_state *state = libwebsock_client_init();
+
+  if (state == NULL)
+  {
+    fprintf(stderr, "unable to create a state\n");
+    exit(1);
+  }
+  state->onmessage = test_onmessage;
+  state->onerror = test_onerror;
+  return state;
+}
+
+//runs the server side of the handshake and throws the response away
+void test_accept(libwebsock_client_state *server, const char *extensions)
+{
+  char request[512], response[1024];
+
+  snprintf(request, sizeof(request), "GET / HTTP/1.1\r\n"
+                                     "Host: localhost\r\n"
+                                     "Upgrade: websocket\r\n"
+                                     "Connection: Upgrade\r\n"
+                                     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                     "Sec-WebSocket-Version: 13\r\n"
+                                     "%s%s%s\r\n",
+           extensions != NULL ? "Sec-WebSocket-Extensions: " : "", extensions != NULL ? extensions : "",
+           extensions != NULL ? "\r\n" : "");
+  if (libwebsock_populate_handshake(server, request, strlen(request)) != 0)
+  {
+    fprintf(stderr, "server handshake failed\n");
+    exit(1);
+  }
+  test_drain(server, response, sizeof(response));
+}
+
+//takes both states through the handshake, the client's offers included
+void test_connect(libwebsock_client_state *client, libwebsock_client_state *server)
+{
+  char request[1024], response[1024];
+  size_t len;
+
+  if (libwebsock_make_client_handshake(client, "localhost", "/", NULL) != 0)
+  {
+    fprintf(stderr, "unable to make the client handshake\n");
+    exit(1);
+  }
+  len = test_drain(client, request, sizeof(request));
+  if (libwebsock_populate_handshake(server, request, len) != 0)
+  {
+    fprintf(stderr, "server handshake failed\n");
+    exit(1);
+  }
+  len = test_drain(server, response, sizeof(response));
+  if (libwebsock_verify_handshake_response(client, response, len) <= 0)
+  {
+    fprintf(stderr, "client rejected the handshake response\n");
+    exit(1);
+  }
+}
+
+//copies out and consumes everything queued, NUL terminated
+size_t test_drain(libwebsock_client_state *state, char *out, size_t out_len)
+{
+  struct iovec iov[16];
+  size_t len = 0;
+  int n, iovcnt;
+
+  while ((iovcnt = libwebsock_output_iov(state, iov, 16)) > 0)
+  {
+    for (n = 0; n < iovcnt; n++)
+    {
+      if (len + iov[n].iov_len >= out_len)
+      {
+        fprintf(stderr, "more output than expected\n");
+        exit(1);
+      }
+      memcpy(out + len, iov[n].iov_base, iov[n].iov_len);
+      len += iov[n].iov_len;
+      libwebsock_output_consume(state, iov[n].iov_len);
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
+
+//a masked frame as a client sends it, with the mask from RFC 6455's examples
+size_t test_client_frame(char *out, int flags, const char *payload, size_t len)
+{
+  static const unsigned char mask[MASK_LENGTH] = {0x37, 0xfa, 0x21, 0x3d};
+  size_t n = 0, i;
+  int shift;
+
+  out[n++] = (char)flags;
+  if (len < 126)
+  {
+    out[n++] = (char)(0x80 | len);
+  }
+  else if (len <= 0xffff)
+  {
+    out[n++] = (char)(0x80 | 126);
+    out[n++] = (char)(len >> 8);
+    out[n++] = (char)len;
+  }
+  else
+  {
+    out[n++] = (char)(0x80 | 127);
+    for (shift = 56; shift >= 0; shift -= 8)
+    {
+      out[n++] = (char)((unsigned long long)len >> shift);
+    }
+  }
+  memcpy(out + n, mask, MASK_LENGTH);
+  n += MASK_LENGTH;
+  for (i = 0; i < len; i++)
+  {
+    out[n + i] = payload[i] ^ mask[i % MASK_LENGTH];
+  }
+  return n + len;
+}
+
+void test_reset(void)
+{
+  memset(&received, 0, sizeof(received));
+}
+
+int test_done(const char *name)
+{
+  if (test_failures > 0)
+  {
+    fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef HARNESS_H_
+#define HARNESS_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include "websock.h"
+
+//what the callbacks installed by the harness have seen
+typedef struct _test_record
+{
+  int messages;
+  unsigned int opcode;
+  size_t payload_len;
+  const char *payload_at;
+  char payload[256 * 1024];
+  int errors;
+  unsigned short close_code;
+} test_record;
+
+extern test_record received;
+extern int test_failures;
+
+#define CHECK(cond)                                                          \
+  do                                                                         \
+  {                                                                          \
+    if (!(cond))                                                             \
+    {                                                                        \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failures++;                                                       \
+    }                                                                        \
+  } while (0)
+
+libwebsock_client_state *test_state(void);
+void test_accept(libwebsock_client_state *server, const char *extensions);
+void test_connect(libwebsock_client_state *client, libwebsock_client_state *server);
+size_t test_drain(libwebsock_client_state *state, char *out, size_t out_len);
+size_t test_client_frame(char *out, int flags, const char *payload, size_t len);
+void test_reset(void);
+int test_done(const char *name);
+#endif /* HARNESS_H_ */
@@ -0,0 +1,164 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * Whole frames handed to libwebsock_handle_recv_inplace are unmasked where
+ * they sit and delivered as views into the caller's buffer, while
+ * libwebsock_handle_recv leaves its buffer alone.  A frame cut off at the
+ * end of the buffer is staged until the rest arrives.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+#define MAX_MESSAGES 8
+
+static struct
+{
+  int count;
+  const char *at[MAX_MESSAGES];
+  size_t len[MAX_MESSAGES];
+  char data[MAX_MESSAGES][512];
+} seen;
+
+static int record_message(libwebsock_client_state *state, libwebsock_message *msg)
+{
+  (void)state;
+  if (seen.count < MAX_MESSAGES && msg->payload_len < sizeof(seen.data[0]))
+  {
+    seen.at[seen.count] = msg->payload;
+    seen.len[seen.count] = msg->payload_len;
+    memcpy(seen.data[seen.count], msg->payload, msg->payload_len);
+    seen.count++;
+  }
+  return 0;
+}
+
+static libwebsock_client_state *make_server(void)
+{
+  libwebsock_client_state *server = test_state();
+
+  test_reset();
+  memset(&seen, 0, sizeof(seen));
+  test_accept(server, NULL);
+  server->onmessage = record_message;
+  return server;
+}
+
+//a text and a binary frame back to back, returns where the second starts
+static size_t two_frames(char *buf, size_t *len)
+{
+  char binary[200];
+  size_t first;
+
+  memset(binary, 'b', sizeof(binary));
+  first = test_client_frame(buf, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "hello", 5);
+  *len = first + test_client_frame(buf + first, WS_FRAGMENT_FIN | WS_OPCODE_BINARY, binary, sizeof(binary));
+  return first;
+}
+
+static void test_inplace(void)
+{
+  libwebsock_client_state *server = make_server();
+  char buf[512], orig[512];
+  size_t len, second = two_frames(buf, &len);
+
+  memcpy(orig, buf, len);
+  libwebsock_handle_recv_inplace(server, buf, len);
+  CHECK(received.errors == 0);
+  CHECK(seen.count == 2);
+  CHECK(seen.at[0] == buf && seen.len[0] == 5 && memcmp(seen.data[0], "hello", 5) == 0);
+  CHECK(seen.at[1] == buf + second && seen.len[1] == 200 && seen.data[1][0] == 'b' && seen.data[1][199] == 'b');
+  CHECK(memcmp(buf, orig, len) != 0);
+  libwebsock_client_destroy(server);
+}
+
+static void test_const(void)
+{
+  libwebsock_client_state *server = make_server();
+  char buf[512], orig[512];
+  size_t len;
+
+  two_frames(buf, &len);
+  memcpy(orig, buf, len);
+  libwebsock_handle_recv(server, buf, len);
+  CHECK(received.errors == 0);
+  CHECK(seen.count == 2);
+  CHECK(seen.len[0] == 5 && memcmp(seen.data[0], "hello", 5) == 0);
+  CHECK(seen.len[1] == 200 && seen.data[1][0] == 'b' && seen.data[1][199] == 'b');
+  CHECK(seen.at[0] < buf || seen.at[0] >= buf + len);
+  CHECK(memcmp(buf, orig, len) == 0);
+  libwebsock_client_destroy(server);
+}
+
+//the frame the buffer ends in is completed by the next one
+static void test_split_tail(void)
+{
+  libwebsock_client_state *server;
+  char buf[512];
+  size_t len, split, second;
+
+  second = two_frames(buf, &len);
+  for (split = second + 1; split < len; split += 23)
+  {
+    server = make_server();
+    two_frames(buf, &len);
+    libwebsock_handle_recv_inplace(server, buf, split);
+    CHECK(seen.count == 1 && seen.at[0] == buf);
+    libwebsock_handle_recv_inplace(server, buf + split, len - split);
+    CHECK(received.errors == 0);
+    CHECK(seen.count == 2 && seen.len[1] == 200 && seen.data[1][0] == 'b' && seen.data[1][199] == 'b');
+    libwebsock_client_destroy(server);
+  }
+}
+
+//a ping between two messages is answered, invalid UTF-8 fails the connection
+static void test_control_and_errors(void)
+{
+  libwebsock_client_state *server = make_server();
+  char buf[512], out[64];
+  size_t len;
+
+  len = test_client_frame(buf, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "one", 3);
+  len += test_client_frame(buf + len, WS_FRAGMENT_FIN | WS_OPCODE_PING, "pp", 2);
+  len += test_client_frame(buf + len, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "two", 3);
+  libwebsock_handle_recv_inplace(server, buf, len);
+  CHECK(received.errors == 0);
+  CHECK(seen.count == 2 && memcmp(seen.data[0], "one", 3) == 0 && memcmp(seen.data[1], "two", 3) == 0);
+  len = test_drain(server, out, sizeof(out));
+  CHECK(len == 4 && memcmp(out, "\x8a\x02pp", 4) == 0);
+  libwebsock_client_destroy(server);
+
+  server = make_server();
+  len = test_client_frame(buf, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, "\xc3\x28", 2);
+  libwebsock_handle_recv_inplace(server, buf, len);
+  CHECK(seen.count == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_WRONG_TYPE);
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  test_inplace();
+  test_const();
+  test_split_tail();
+  test_control_and_errors();
+  return test_done("inplace-recv");
+}
@@ -0,0 +1,275 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * The vector unmask and UTF-8 kernels picked at runtime against plain
+ * byte-at-a-time versions written here, over every length and alignment
+ * around the vector widths and over randomly built and broken text.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+#define ROUNDS 4000
+
+static const unsigned char mask[MASK_LENGTH] = {0x8d, 0x31, 0xe4, 0x5a};
+
+static void ref_unmask(char *dst, const char *src, size_t len, size_t offset)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    dst[i] = src[i] ^ mask[(offset + i) % MASK_LENGTH];
+  }
+}
+
+//whether s is valid UTF-8, straight from the table in RFC 3629
+static int ref_utf8(const unsigned char *s, size_t len)
+{
+  size_t i = 0, n, k;
+  unsigned int c, min;
+
+  while (i < len)
+  {
+    c = s[i];
+    if (c < 0x80)
+    {
+      i++;
+      continue;
+    }
+    else if (c >= 0xc2 && c <= 0xdf)
+    {
+      n = 1, min = 0x80, c &= 0x1f;
+    }
+    else if (c >= 0xe0 && c <= 0xef)
+    {
+      n = 2, min = 0x800, c &= 0x0f;
+    }
+    else if (c >= 0xf0 && c <= 0xf4)
+    {
+      n = 3, min = 0x10000, c &= 0x07;
+    }
+    else
+    {
+      return 0;
+    }
+    if (i + n >= len)
+    {
+      return 0;
+    }
+    for (k = 1; k <= n; k++)
+    {
+      if ((s[i + k] & 0xc0) != 0x80)
+      {
+        return 0;
+      }
+      c = c << 6 | (s[i + k] & 0x3f);
+    }
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+    {
+      return 0;
+    }
+    i += n + 1;
+  }
+  return 1;
+}
+
+static unsigned int next_random(void)
+{
+  static unsigned int seed = 12345;
+
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static void fill_random(char *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    buf[i] = (char)next_random();
+  }
+}
+
+//every length and alignment through a word and a few vectors, in place and not
+static void test_unmask(void)
+{
+  char src[1200], dst[1200], expected[1200];
+  size_t len, align, offset, shift;
+
+  fill_random(src, sizeof(src));
+  for (len = 0; len < 300; len++)
+  {
+    for (align = 0; align < 8; align++)
+    {
+      for (offset = 0; offset < MASK_LENGTH; offset++)
+      {
+        memset(dst, 0x55, sizeof(dst));
+        lws_unmask(dst + align, src + 64 + align, len, mask, offset);
+        ref_unmask(expected, src + 64 + align, len, offset);
+        CHECK(memcmp(dst + align, expected, len) == 0);
+        CHECK(dst[align + len] == 0x55 && (align == 0 || dst[align - 1] == 0x55));
+      }
+    }
+  }
+
+  //dst over src, and down over a frame header as in-place delivery does
+  for (shift = 0; shift <= 14; shift += 2)
+  {
+    for (len = 0; len < 1000; len += 61)
+    {
+      fill_random(src, sizeof(src));
+      ref_unmask(expected, src + 20, len, 1);
+      lws_unmask(src + 20 - shift, src + 20, len, mask, 1);
+      CHECK(memcmp(src + 20 - shift, expected, len) == 0);
+    }
+  }
+}
+
+static const char *const pieces[] = {
+    "a", "0123456789abcdef", "\x7f", "\xc2\x80", "\xdf\xbf", "\xc3\xa9", "\xe0\xa0\x80", "\xe2\x82\xac",
+    "\xed\x9f\xbf", "\xee\x80\x80", "\xef\xbf\xbf", "\xf0\x90\x80\x80", "\xf4\x8f\xbf\xbf",
+    "\xf0\x9f\x98\x80", "the quick brown fox jumps over the lazy dog"};
+
+//valid text of mixed widths, then maybe broken by a byte or cut short
+static size_t make_text(unsigned char *out, size_t max)
+{
+  size_t len = 0, n;
+  const char *piece;
+
+  for (;;)
+  {
+    piece = pieces[next_random() % (sizeof(pieces) / sizeof(pieces[0]))];
+    n = strlen(piece);
+    if (len + n > max || next_random() % 40 == 0)
+    {
+      break;
+    }
+    memcpy(out + len, piece, n);
+    len += n;
+  }
+  switch (next_random() % 4)
+  {
+  case 0:
+    if (len > 0)
+    {
+      out[next_random() % len] = (unsigned char)next_random();
+    }
+    break;
+  case 1:
+    if (len > 0)
+    {
+      len -= next_random() % (len < 3 ? len : 3);
+    }
+    break;
+  }
+  return len;
+}
+
+//known bad sequences after ASCII runs of every length, to hit each lane
+static void test_utf8_known(void)
+{
+  static const char *const bad[] = {"\x80", "\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x9f\xbf",
+                                    "\xed\xa0\x80", "\xed\xbf\xbf", "\xf0\x8f\xbf\xbf", "\xf4\x90\x80\x80",
+                                    "\xf5\x80\x80\x80", "\xff", "\xe2\x82", "\xc3"};
+  unsigned char buf[256];
+  size_t i, run, n;
+
+  for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+  {
+    n = strlen(bad[i]);
+    for (run = 0; run < 130; run++)
+    {
+      memset(buf, 'x', run);
+      memcpy(buf + run, bad[i], n);
+      CHECK(lws_utf8_validate(UTF8_ACCEPT, buf, run + n) != UTF8_ACCEPT);
+      memset(buf + run + n, 'y', 40);
+      CHECK(lws_utf8_validate(UTF8_ACCEPT, buf, run + n + 40) != UTF8_ACCEPT);
+    }
+  }
+}
+
+//random text whole and split at a random point against the reference
+static void test_utf8_random(void)
+{
+  unsigned char text[512];
+  size_t len, split, round;
+  uint32_t state;
+  int valid;
+
+  for (round = 0; round < ROUNDS; round++)
+  {
+    len = make_text(text, sizeof(text));
+    valid = ref_utf8(text, len);
+    CHECK((lws_utf8_validate(UTF8_ACCEPT, text, len) == UTF8_ACCEPT) == valid);
+
+    split = len > 0 ? next_random() % len : 0;
+    state = lws_utf8_validate(UTF8_ACCEPT, text, split);
+    if (state != UTF8_REJECT)
+    {
+      state = lws_utf8_validate(state, text + split, len - split);
+    }
+    CHECK((state == UTF8_ACCEPT) == valid);
+  }
+}
+
+//masked random text unmasks to the original and validates like it
+static void test_unmask_utf8(void)
+{
+  unsigned char text[512];
+  char masked[512], dst[512];
+  size_t len, offset, split, round;
+  uint32_t state;
+  int valid;
+
+  for (round = 0; round < ROUNDS; round++)
+  {
+    len = make_text(text, sizeof(text));
+    valid = ref_utf8(text, len);
+    offset = round % MASK_LENGTH;
+    ref_unmask(masked, (const char *)text, len, offset);
+
+    //rejected text may be left partly masked
+    state = lws_unmask_utf8(dst, masked, len, mask, offset, UTF8_ACCEPT);
+    CHECK(!valid || memcmp(dst, text, len) == 0);
+    CHECK((state == UTF8_ACCEPT) == valid);
+
+    //in place and in two pieces, as streamed chunks are
+    split = len > 0 ? next_random() % len : 0;
+    state = lws_unmask_utf8(masked, masked, split, mask, offset, UTF8_ACCEPT);
+    if (state != UTF8_REJECT)
+    {
+      state = lws_unmask_utf8(masked + split, masked + split, len - split, mask, offset + split, state);
+    }
+    CHECK(!valid || memcmp(masked, text, len) == 0);
+    CHECK((state == UTF8_ACCEPT) == valid);
+  }
+}
+
+int main(void)
+{
+  test_unmask();
+  test_utf8_known();
+  test_utf8_random();
+  test_unmask_utf8();
+  return test_done("kernels");
+}
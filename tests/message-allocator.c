@@ -0,0 +1,181 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * A message allocator with a reset hook, as an arena would use it, and a
+ * state allocator that runs out of memory partway through a message.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static char message[64 * 1024];
+static char wire[128 * 1024];
+
+//counts what is outstanding, as an arena would
+static size_t arena_live;
+static size_t arena_allocs;
+static int arena_resets;
+
+static void *arena_malloc(void *ctx, size_t size)
+{
+  (void)ctx;
+  arena_live++;
+  arena_allocs++;
+  return malloc(size);
+}
+
+static void *arena_realloc(void *ctx, void *ptr, size_t size)
+{
+  (void)ctx;
+  arena_live += ptr == NULL;
+  arena_allocs++;
+  return realloc(ptr, size);
+}
+
+static void arena_free(void *ctx, void *ptr)
+{
+  (void)ctx;
+  arena_live--;
+  free(ptr);
+}
+
+static void arena_reset(void *ctx)
+{
+  (void)ctx;
+  CHECK(arena_live == 0);
+  arena_resets++;
+}
+
+static const libwebsock_allocator arena = {arena_malloc, arena_realloc, arena_free, NULL};
+
+//libc, until told to fail
+static int out_of_memory;
+
+static void *failing_malloc(void *ctx, size_t size)
+{
+  (void)ctx;
+  return out_of_memory ? NULL : malloc(size);
+}
+
+static void *failing_realloc(void *ctx, void *ptr, size_t size)
+{
+  (void)ctx;
+  return out_of_memory ? NULL : realloc(ptr, size);
+}
+
+static void failing_free(void *ctx, void *ptr)
+{
+  (void)ctx;
+  free(ptr);
+}
+
+static const libwebsock_allocator failing = {failing_malloc, failing_realloc, failing_free, NULL};
+
+//every payload buffer is released before the message allocator is reset
+static void test_reset_hook(void)
+{
+  libwebsock_client_state *server = test_state();
+  size_t len;
+  int round;
+
+  CHECK(libwebsock_set_message_allocator(server, &arena, arena_reset) == 0);
+  test_accept(server, NULL);
+  CHECK(libwebsock_set_message_allocator(server, &arena, arena_reset) == -1);
+
+  for (round = 1; round <= 2; round++)
+  {
+    test_reset();
+    len = test_client_frame(wire, WS_OPCODE_BINARY, message, 100);
+    len += test_client_frame(wire + len, WS_OPCODE_CONTINUE, message + 100, 20000);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, message + 20100, 100);
+    libwebsock_handle_recv_inplace(server, wire, len);
+    CHECK(received.errors == 0);
+    CHECK(received.messages == 1 && received.payload_len == 20200 && memcmp(received.payload, message, 20200) == 0);
+    CHECK(arena_allocs > 0);
+    CHECK(arena_resets == round);
+    CHECK(arena_live == 0);
+  }
+  libwebsock_client_destroy(server);
+}
+
+//inflated messages come from the message allocator too
+static void test_inflated(void)
+{
+  libwebsock_client_state *client = test_state(), *server = test_state();
+  int resets;
+  size_t len;
+
+  CHECK(libwebsock_enable_deflate(client, NULL) == 0);
+  CHECK(libwebsock_enable_deflate(server, NULL) == 0);
+  CHECK(libwebsock_set_message_allocator(server, &arena, arena_reset) == 0);
+  test_connect(client, server);
+
+  test_reset();
+  resets = arena_resets;
+  arena_allocs = 0;
+  CHECK(libwebsock_make_text_data_frame_with_length(client, message, 2048) != -1);
+  len = test_drain(client, wire, sizeof(wire));
+  CHECK(len > 0 && (wire[0] & WS_FRAGMENT_RSV1) != 0);
+  libwebsock_handle_recv_inplace(server, wire, len);
+  CHECK(received.errors == 0);
+  CHECK(received.messages == 1 && received.payload_len == 2048 && memcmp(received.payload, message, 2048) == 0);
+  CHECK(arena_allocs > 0 && arena_resets == resets + 1 && arena_live == 0);
+  libwebsock_client_destroy(client);
+  libwebsock_client_destroy(server);
+}
+
+//running out of memory fails the connection with 1011 and leaves it destroyable
+static void test_out_of_memory(void)
+{
+  libwebsock_client_state *server = libwebsock_client_init_with_allocator(&failing);
+  libwebsock_client_state *plain = test_state();
+  size_t len;
+
+  CHECK(server != NULL);
+  server->onmessage = plain->onmessage;
+  server->onerror = plain->onerror;
+  libwebsock_client_destroy(plain);
+  test_reset();
+  test_accept(server, NULL);
+
+  out_of_memory = 1;
+  len = test_client_frame(wire, WS_OPCODE_BINARY, message, 100);
+  len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, message + 100, 50000);
+  libwebsock_handle_recv(server, wire, len);
+  CHECK(received.messages == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_UNEXPECTED_ERROR);
+  out_of_memory = 0;
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(message); i++)
+  {
+    message[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+  }
+  test_reset_hook();
+  test_inflated();
+  test_out_of_memory();
+  return test_done("message-allocator");
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * libwebsock_reserve and libwebsock_commit with other frames queued in
+ * between: they go out ahead of the reserved one and leave it intact.  A
+ * commit the peer would have to reject is refused and gives the space back.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+//the automatic pong for a ping received while space is reserved
+static void test_interleaved_pong(void)
+{
+  libwebsock_client_state *server = test_state();
+  const char expected[] = "\x8a\x02xx\x82\x07payload";
+  char ping[16], out[64], *space;
+  size_t len;
+
+  test_reset();
+  test_accept(server, NULL);
+  space = libwebsock_reserve(server, 16);
+  CHECK(space != NULL);
+  memcpy(space, "payload", 7);
+
+  len = test_client_frame(ping, WS_FRAGMENT_FIN | WS_OPCODE_PING, "xx", 2);
+  libwebsock_handle_recv(server, ping, len);
+  CHECK(received.errors == 0);
+
+  CHECK(libwebsock_commit(server, 7, WS_OPCODE_BINARY) != -1);
+  len = test_drain(server, out, sizeof(out));
+  CHECK(len == sizeof(expected) - 1 && memcmp(out, expected, len) == 0);
+  libwebsock_client_destroy(server);
+}
+
+//a data frame sent while space is reserved, and a second reservation after
+static void test_interleaved_data(void)
+{
+  libwebsock_client_state *server = test_state();
+  const char expected[] = "\x81\x05hello\x82\x03one\x82\x03two";
+  char out[64], *space;
+  size_t len;
+
+  test_accept(server, NULL);
+  space = libwebsock_reserve(server, 8);
+  CHECK(space != NULL);
+  CHECK(libwebsock_reserve(server, 8) == NULL);
+  memcpy(space, "one", 3);
+  CHECK(libwebsock_make_text_data_frame(server, "hello") != -1);
+  CHECK(libwebsock_commit(server, 3, WS_OPCODE_BINARY) != -1);
+
+  space = libwebsock_reserve(server, 8);
+  CHECK(space != NULL);
+  memcpy(space, "two", 3);
+  CHECK(libwebsock_commit(server, 3, WS_OPCODE_BINARY) != -1);
+
+  len = test_drain(server, out, sizeof(out));
+  CHECK(len == sizeof(expected) - 1 && memcmp(out, expected, len) == 0);
+  libwebsock_client_destroy(server);
+}
+
+//commits with the given opcode and payload, returns what it did
+static ssize_t try_commit(libwebsock_client_state *server, int opcode, const char *payload, size_t len)
+{
+  char *space = libwebsock_reserve(server, 200);
+
+  if (space == NULL)
+  {
+    return -2;
+  }
+  memcpy(space, payload, len);
+  return libwebsock_commit(server, len, opcode);
+}
+
+static void test_refused(void)
+{
+  libwebsock_client_state *server = test_state();
+  const char expected[] = "\x89\x02pp\x81\x02\xc3\xa9";
+  char payload[200], out[512];
+  size_t len;
+  int opcode;
+
+  test_accept(server, NULL);
+  memset(payload, 'p', sizeof(payload));
+  for (opcode = 0x3; opcode <= 0xf; opcode++)
+  {
+    if (opcode < 0x8 || opcode > 0xa)
+    {
+      CHECK(try_commit(server, opcode, payload, 2) == -1);
+    }
+  }
+  CHECK(try_commit(server, WS_OPCODE_CONTINUE, payload, 2) == -1);
+  CHECK(try_commit(server, WS_OPCODE_BINARY | WS_FRAGMENT_FIN, payload, 2) == -1);
+  CHECK(try_commit(server, WS_OPCODE_PING, payload, 126) == -1);
+  CHECK(try_commit(server, WS_OPCODE_TEXT, "\xc3\x28", 2) == -1);
+  CHECK(try_commit(server, WS_OPCODE_TEXT, "\xc3", 1) == -1);
+  CHECK(libwebsock_output_pending(server) == 0);
+
+  CHECK(try_commit(server, WS_OPCODE_PING, payload, 2) != -1);
+  CHECK(try_commit(server, WS_OPCODE_TEXT, "\xc3\xa9", 2) != -1);
+  len = test_drain(server, out, sizeof(out));
+  CHECK(len == sizeof(expected) - 1 && memcmp(out, expected, len) == 0);
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  test_interleaved_pong();
+  test_interleaved_data();
+  test_refused();
+  return test_done("reserve-commit");
+}
@@ -0,0 +1,142 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Send lanes with the default max_outbound_frame_size of 0: bulk data is
+ * still split into fragments and a high priority message goes ahead of the
+ * bulk messages queued before it.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+#define MAX_FRAMES 16
+
+typedef struct
+{
+  int flags;
+  size_t len;
+} wire_frame;
+
+static char bulk[40 * 1024];
+static char wire[256 * 1024];
+
+//splits server output into its frames, returns how many there were
+static int parse_frames(const char *data, size_t len, wire_frame *frames)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t i = 0, payload_len;
+  int n = 0, shift;
+
+  while (i + 2 <= len && n < MAX_FRAMES)
+  {
+    frames[n].flags = p[i];
+    payload_len = p[i + 1] & 0x7f;
+    i += 2;
+    if (payload_len == 126)
+    {
+      payload_len = (size_t)p[i] << 8 | p[i + 1];
+      i += 2;
+    }
+    else if (payload_len == 127)
+    {
+      payload_len = 0;
+      for (shift = 0; shift < 8; shift++)
+      {
+        payload_len = payload_len << 8 | p[i + shift];
+      }
+      i += 8;
+    }
+    frames[n++].len = payload_len;
+    i += payload_len;
+  }
+  return n;
+}
+
+static void test_bulk_fragments(void)
+{
+  libwebsock_client_state *server = test_state();
+  wire_frame frames[MAX_FRAMES];
+  size_t len;
+  int n;
+
+  test_accept(server, NULL);
+  CHECK(libwebsock_set_send_priority(server, WS_PRIORITY_BULK) == 0);
+  CHECK(libwebsock_make_binary_data_frame(server, bulk, sizeof(bulk)) != -1);
+  len = test_drain(server, wire, sizeof(wire));
+  n = parse_frames(wire, len, frames);
+  CHECK(n == 3);
+  CHECK(frames[0].flags == WS_OPCODE_BINARY && frames[0].len == OUTPUT_LANE_FRAGMENT_SIZE);
+  CHECK(frames[1].flags == WS_OPCODE_CONTINUE && frames[1].len == OUTPUT_LANE_FRAGMENT_SIZE);
+  CHECK(frames[2].flags == (WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE) &&
+        frames[2].len == sizeof(bulk) - 2 * OUTPUT_LANE_FRAGMENT_SIZE);
+  libwebsock_client_destroy(server);
+}
+
+static void test_high_overtakes_bulk(void)
+{
+  libwebsock_client_state *server = test_state();
+  wire_frame frames[MAX_FRAMES];
+  size_t len;
+  int n;
+
+  test_accept(server, NULL);
+  CHECK(libwebsock_set_send_priority(server, WS_PRIORITY_BULK) == 0);
+  CHECK(libwebsock_make_binary_data_frame(server, bulk, sizeof(bulk)) != -1);
+  CHECK(libwebsock_make_binary_data_frame(server, bulk, sizeof(bulk)) != -1);
+  CHECK(libwebsock_set_send_priority(server, WS_PRIORITY_HIGH) == 0);
+  CHECK(libwebsock_make_text_data_frame(server, "hi") != -1);
+
+  len = test_drain(server, wire, sizeof(wire));
+  n = parse_frames(wire, len, frames);
+  CHECK(n == 7);
+  CHECK(frames[0].flags == (WS_FRAGMENT_FIN | WS_OPCODE_TEXT) && frames[0].len == 2);
+  CHECK(frames[1].flags == WS_OPCODE_BINARY && frames[4].flags == WS_OPCODE_BINARY);
+  CHECK(frames[3].flags == (WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE));
+  CHECK(frames[6].flags == (WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE));
+  libwebsock_client_destroy(server);
+}
+
+//without the bulk lane nothing changes: one frame per message, in order
+static void test_high_only(void)
+{
+  libwebsock_client_state *server = test_state();
+  wire_frame frames[MAX_FRAMES];
+  size_t len;
+  int n;
+
+  test_accept(server, NULL);
+  CHECK(libwebsock_make_binary_data_frame(server, bulk, sizeof(bulk)) != -1);
+  CHECK(libwebsock_make_text_data_frame(server, "hi") != -1);
+  len = test_drain(server, wire, sizeof(wire));
+  n = parse_frames(wire, len, frames);
+  CHECK(n == 2);
+  CHECK(frames[0].flags == (WS_FRAGMENT_FIN | WS_OPCODE_BINARY) && frames[0].len == sizeof(bulk));
+  CHECK(frames[1].flags == (WS_FRAGMENT_FIN | WS_OPCODE_TEXT) && frames[1].len == 2);
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  memset(bulk, 'b', sizeof(bulk));
+  test_bulk_fragments();
+  test_high_overtakes_bulk();
+  test_high_only();
+  return test_done("send-priority");
+}
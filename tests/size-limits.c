@@ -0,0 +1,122 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * max_frame_size and max_message_size: a frame that would go over either is
+ * refused with 1009 as soon as its header is read, before its payload.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static char payload[4096];
+static char wire[8192];
+
+static libwebsock_client_state *make_server(size_t max_frame_size, size_t max_message_size)
+{
+  libwebsock_client_state *server = test_state();
+
+  test_reset();
+  test_accept(server, NULL);
+  server->max_frame_size = max_frame_size;
+  server->max_message_size = max_message_size;
+  return server;
+}
+
+static void test_frame_limit(void)
+{
+  libwebsock_client_state *server;
+  size_t len;
+
+  //exactly at the limit is fine
+  server = make_server(1000, 0);
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_BINARY, payload, 1000);
+  libwebsock_handle_recv_inplace(server, wire, len);
+  CHECK(received.errors == 0 && received.messages == 1 && received.payload_len == 1000);
+  libwebsock_client_destroy(server);
+
+  //one over is refused on the header alone, which is all there is so far
+  server = make_server(1000, 0);
+  test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_BINARY, payload, 1001);
+  libwebsock_handle_recv(server, wire, 8);
+  CHECK(received.messages == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_MESSAGE_TOO_BIG);
+  libwebsock_client_destroy(server);
+
+  //control frames have their own limit of 125
+  server = make_server(10, 0);
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_PING, payload, 100);
+  libwebsock_handle_recv_inplace(server, wire, len);
+  CHECK(received.errors == 0);
+  libwebsock_client_destroy(server);
+}
+
+//the message limit counts the fragments received so far
+static void test_message_limit(void)
+{
+  libwebsock_client_state *server;
+  size_t len;
+
+  server = make_server(0, 3000);
+  len = test_client_frame(wire, WS_OPCODE_BINARY, payload, 1500);
+  len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, payload, 1500);
+  libwebsock_handle_recv_inplace(server, wire, len);
+  CHECK(received.errors == 0 && received.messages == 1 && received.payload_len == 3000);
+  libwebsock_client_destroy(server);
+
+  server = make_server(0, 3000);
+  len = test_client_frame(wire, WS_OPCODE_BINARY, payload, 1500);
+  len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, payload, 1501);
+  libwebsock_handle_recv(server, wire, len - 1501);
+  CHECK(received.messages == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_MESSAGE_TOO_BIG);
+  libwebsock_client_destroy(server);
+
+  //an unfragmented message over the limit
+  server = make_server(0, 3000);
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, payload, 3001);
+  libwebsock_handle_recv_inplace(server, wire, len);
+  CHECK(received.messages == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_MESSAGE_TOO_BIG);
+  libwebsock_client_destroy(server);
+}
+
+//new states start with the defaults, existing ones keep theirs
+static void test_defaults(void)
+{
+  libwebsock_client_state *before = test_state(), *after;
+
+  libwebsock_set_default_size_limits(100, 200);
+  after = test_state();
+  CHECK(before->max_frame_size == 0 && before->max_message_size == 0);
+  CHECK(after->max_frame_size == 100 && after->max_message_size == 200);
+  libwebsock_set_default_size_limits(0, 0);
+  libwebsock_client_destroy(before);
+  libwebsock_client_destroy(after);
+}
+
+int main(void)
+{
+  memset(payload, 'p', sizeof(payload));
+  test_frame_limit();
+  test_message_limit();
+  test_defaults();
+  return test_done("size-limits");
+}
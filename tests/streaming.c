@@ -0,0 +1,191 @@
+/*
+ * This file is part of libwebsock
+ *
+ * Copyright (C) 2012-2013 Payden Sutherland
+ *
+ * libwebsock is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * libwebsock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libwebsock; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+
+/*
+ * onmessage_chunk: payloads handed over as they arrive, with reads cut at
+ * every kind of place inside a frame, through both receive calls.
+ */
+
+#include <string.h>
+#include "harness.h"
+
+static char payload[100 * 1024];
+static char wire[2 * 100 * 1024];
+static char copy[2 * 100 * 1024];
+
+static struct
+{
+  int chunks;
+  int firsts;
+  int finals;
+  int out_of_order;
+  unsigned int opcode;
+  size_t len;
+  size_t largest;
+  char data[2 * 100 * 1024];
+} streamed;
+
+static int record_chunk(libwebsock_client_state *state, unsigned int opcode, char *data, size_t len, int is_first,
+                        int is_final)
+{
+  (void)state;
+  streamed.out_of_order += is_first != (streamed.chunks == 0) || streamed.finals > 0;
+  streamed.chunks++;
+  streamed.firsts += is_first;
+  streamed.finals += is_final;
+  streamed.opcode = opcode;
+  if (streamed.len + len <= sizeof(streamed.data))
+  {
+    memcpy(streamed.data + streamed.len, data, len);
+  }
+  streamed.len += len;
+  if (len > streamed.largest)
+  {
+    streamed.largest = len;
+  }
+  return 0;
+}
+
+static libwebsock_client_state *make_server(void)
+{
+  libwebsock_client_state *server = test_state();
+
+  test_reset();
+  memset(&streamed, 0, sizeof(streamed));
+  test_accept(server, NULL);
+  server->onmessage_chunk = record_chunk;
+  return server;
+}
+
+//feeds wire in reads of the given sizes, cycling through them
+static void feed(libwebsock_client_state *server, size_t len, const size_t *reads, size_t nreads, int inplace)
+{
+  size_t i = 0, n, r = 0;
+
+  memcpy(copy, wire, len);
+  while (i < len && received.errors == 0)
+  {
+    n = reads[r++ % nreads];
+    if (n > len - i)
+    {
+      n = len - i;
+    }
+    if (inplace)
+    {
+      libwebsock_handle_recv_inplace(server, copy + i, n);
+    }
+    else
+    {
+      libwebsock_handle_recv(server, copy + i, n);
+    }
+    i += n;
+  }
+}
+
+static void check_message(unsigned int opcode, const char *data, size_t len)
+{
+  CHECK(received.errors == 0);
+  CHECK(received.messages == 0);
+  CHECK(streamed.firsts == 1 && streamed.finals == 1 && streamed.out_of_order == 0);
+  CHECK(streamed.opcode == opcode);
+  CHECK(streamed.len == len && memcmp(streamed.data, data, len) == 0);
+}
+
+//reads ending inside the header, the mask, the payload and right at its end
+static void test_split_reads(void)
+{
+  static const size_t reads[][3] = {{1, 1, 1}, {3, 5000, 7}, {9, 65536, 1}, {14, 100 * 1024, 100 * 1024},
+                                    {100 * 1024 + 14, 1, 1}};
+  libwebsock_client_state *server;
+  size_t len, i;
+  int inplace;
+
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_BINARY, payload, sizeof(payload));
+  for (inplace = 0; inplace < 2; inplace++)
+  {
+    for (i = 0; i < sizeof(reads) / sizeof(reads[0]); i++)
+    {
+      server = make_server();
+      feed(server, len, reads[i], 3, inplace);
+      check_message(WS_OPCODE_BINARY, payload, sizeof(payload));
+      if (!inplace)
+      {
+        //the caller's buffer is read only, so chunks come through a bounce buffer
+        CHECK(memcmp(copy, wire, len) == 0);
+        CHECK(streamed.largest <= FRAME_CHUNK_LENGTH);
+      }
+      libwebsock_client_destroy(server);
+    }
+  }
+}
+
+//a fragmented text message with a character cut between its frames and a ping in between
+static void test_fragmented_text(void)
+{
+  static const size_t reads[] = {1, 2, 5, 11};
+  const char text[] = "caf\xc3\xa9 \xe2\x82\xac";
+  char out[64];
+  libwebsock_client_state *server;
+  size_t len, r;
+
+  for (r = 0; r < sizeof(reads) / sizeof(reads[0]); r++)
+  {
+    server = make_server();
+    len = test_client_frame(wire, WS_OPCODE_TEXT, text, 4);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_PING, "pp", 2);
+    len += test_client_frame(wire + len, WS_OPCODE_CONTINUE, text + 4, 3);
+    len += test_client_frame(wire + len, WS_FRAGMENT_FIN | WS_OPCODE_CONTINUE, text + 7, sizeof(text) - 8);
+    feed(server, len, &reads[r], 1, r % 2);
+    check_message(WS_OPCODE_TEXT, text, sizeof(text) - 1);
+    len = test_drain(server, out, sizeof(out));
+    CHECK(len == 4 && memcmp(out, "\x8a\x02pp", 4) == 0);
+    libwebsock_client_destroy(server);
+  }
+}
+
+//bad UTF-8 in a later chunk fails the connection after the first was delivered
+static void test_invalid_text(void)
+{
+  static const size_t reads[] = {1000};
+  libwebsock_client_state *server = make_server();
+  size_t len;
+
+  memset(payload, 'a', 5000);
+  payload[3000] = (char)0xff;
+  len = test_client_frame(wire, WS_FRAGMENT_FIN | WS_OPCODE_TEXT, payload, 5000);
+  feed(server, len, reads, 1, 1);
+  CHECK(streamed.chunks > 0 && streamed.finals == 0);
+  CHECK(received.errors == 1 && received.close_code == WS_CLOSE_WRONG_TYPE);
+  libwebsock_client_destroy(server);
+}
+
+int main(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(payload); i++)
+  {
+    payload[i] = (char)(i * 7);
+  }
+  test_split_reads();
+  test_fragmented_text();
+  test_invalid_text();
+  return test_done("streaming");
+}